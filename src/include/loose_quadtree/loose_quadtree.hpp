@@ -6,6 +6,15 @@
  * See LICENSE file
  */
 
+#include <cstddef>
+#include <functional>
+#include <ratio>
+#include <vector>
+
+#ifdef LQT_USE_STD_PMR
+#include <memory_resource>
+#endif
+
 namespace loose_quadtree {
 
   template<typename NumberT>
@@ -28,12 +37,140 @@ namespace loose_quadtree {
   };
 
 
-  template<typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+#ifdef LQT_USE_STD_PMR
+  using memory_resource = std::pmr::memory_resource;
+#else
+  /// C++11 stand-in for std::pmr::memory_resource with the same interface
+  /// (define LQT_USE_STD_PMR to use the standard one instead)
+  class memory_resource {
+  public:
+    virtual ~memory_resource() = default;
+
+    void* allocate(std::size_t bytes, std::size_t alignment = alignof(std::max_align_t)) {
+      return do_allocate(bytes, alignment);
+    }
+
+    void deallocate(void* p, std::size_t bytes, std::size_t alignment = alignof(std::max_align_t)) {
+      do_deallocate(p, bytes, alignment);
+    }
+
+    bool is_equal(const memory_resource& other) const noexcept {
+      return do_is_equal(other);
+    }
+
+  private:
+    virtual void* do_allocate(std::size_t bytes, std::size_t alignment) = 0;
+
+    virtual void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) = 0;
+
+    virtual bool do_is_equal(const memory_resource& other) const noexcept = 0;
+  };
+#endif
+
+  memory_resource* new_delete_resource();
+
+  /// Pools small allocations in big blocks, big ones are passed to the upstream resource.
+  /// A single instance can be shared by many trees (it is not thread-safe though).
+  class blocks_memory_resource;
+
+
+  /// Usage of a blocks_memory_resource
+  struct blocks_stats {
+    struct size_class {
+      std::size_t slot_size;
+      std::size_t blocks;
+      std::size_t live_slots;
+      std::size_t free_slots;
+    };
+
+    std::size_t block_size = 0;
+    std::vector<size_class> size_classes; ///< only the ones holding blocks
+    std::size_t upstream_allocations = 0; ///< allocations too big for the blocks
+    std::size_t upstream_bytes = 0;
+  };
+
+
+  /// Memory held by a quad_tree, see quad_tree::get_memory_stats()
+  struct memory_stats {
+    blocks_stats own_pool; ///< empty if the tree was given a memory_resource
+    std::size_t nodes = 0;
+    std::size_t node_bytes = 0;
+    std::size_t object_slots = 0; ///< entries in the object buckets of the nodes
+    std::size_t tombstones = 0; ///< entries of objects removed during a query, not cleaned up yet
+    std::size_t object_slot_bytes = 0; ///< bucket capacity included
+    std::size_t object_pointer_buckets = 0;
+    std::size_t object_pointer_bytes = 0; ///< estimate for the object lookup table (buckets and entries), 0 with hooks
+    std::size_t query_pool_size = 0;
+    std::size_t query_pool_bytes = 0;
+  };
+
+
+  /// Room for a quad_tree inside an object, see default_policy::object_hook_extractor.
+  /// Copies start out empty, the copied object is not in the tree.
+  struct object_hook {
+    object_hook() = default;
+
+    object_hook(const object_hook&) {}
+
+    object_hook& operator=(const object_hook&) { return *this; }
+
+    void* slot = nullptr; ///< owned by the tree
+  };
+
+
+  /// Compile time settings of a quad_tree, derive from it and hide the ones to change
+  struct default_policy {
+    /// copy the bounding boxes into the nodes on insert and update, so queries test them
+    /// without calling the BoundingBoxExtractor (objects have to be updated after moving anyway)
+    static constexpr bool cache_bounding_boxes = false;
+    /// link the nodes by 32 bit indices into chunks instead of pointers, which makes
+    /// the nodes and the object slots smaller (with 64 bit pointers)
+    static constexpr bool compact_nodes = false;
+    /// class with a static object_hook* ExtractObjectHook(Object* object) like the BoundingBoxExtractor,
+    /// the tree finds the objects through their hooks instead of a hash map (void for the hash map),
+    /// an object can be in a single tree per hook
+    using object_hook_extractor = void;
+    /// find the objects through an open addressing table instead of a std::unordered_map,
+    /// which needs no allocation per object (not used with an object_hook_extractor)
+    static constexpr bool flat_object_map = false;
+    /// keep in every object slot which centers and sizes its node takes, so updates that stay
+    /// in the node skip the descent from the root (six numbers and eight bytes per object)
+    static constexpr bool cache_node_cells = false;
+    /// place the objects by their bounding boxes grown by a margin (see quad_tree::set_fat_margin)
+    /// and keep these in the object slots, updates inside them return right away
+    /// (queries still test the exact boxes, four numbers per object)
+    static constexpr bool fat_bounding_boxes = false;
+    /// split a node once it would hold more than that many objects small enough for its children,
+    /// instead of sending them all as deep as the number of objects in the tree allows
+    /// (0 for the latter, the nodes split all over the tree the same way then)
+    static constexpr std::size_t node_capacity = 0;
+    /// the depths the objects go down to at least (if they fit) and at most, the root being 0,
+    /// with node_capacity 0 the tree goes deeper between them as the number of objects grows
+    static constexpr int minimal_depth = 4;
+    static constexpr int maximal_depth = 31;
+    /// the size of the loose bounds of a node per its own (above 1, at most 2), a node takes the objects
+    /// up to (looseness - 1) times its size, tighter bounds let queries skip more nodes
+    /// but keep the objects higher up in the tree
+    using looseness = std::ratio<2>;
+  };
+
+
+  /// Runs the tasks quad_tree::build hands it in any order and on any threads,
+  /// returns when all of them are done
+  using build_executor = std::function<void(std::vector<std::function<void()>>& tasks)>;
+
+  /// build_executor on that many std::threads, the calling one included
+  build_executor thread_build_executor(unsigned threads);
+
+
+  template<typename NumberT, typename ObjectT, typename BoundingBoxExtractorT,
+           typename PolicyT = default_policy>
   class quad_tree {
   public:
     using Number = NumberT;
     using Object = ObjectT;
     using BoundingBoxExtractor = BoundingBoxExtractorT;
+    using Policy = PolicyT;
 
   private:
     class impl;
@@ -60,7 +197,7 @@ namespace loose_quadtree {
       void next();
 
     private:
-      friend class quad_tree<Number, Object, BoundingBoxExtractor>::impl;
+      friend class quad_tree<Number, Object, BoundingBoxExtractor, Policy>::impl;
 
       class Impl;
 
@@ -69,8 +206,30 @@ namespace loose_quadtree {
       Impl* pimpl_;
     };
 
+    /// Stable reference to an object in the tree which spares update and remove the lookup
+    /// by object pointer, valid until the object is removed or the tree is cleared
+    class handle {
+    public:
+      handle() = default;
+
+      explicit operator bool() const; ///< false for a default constructed handle
+
+      bool operator==(const handle& other) const;
+
+      bool operator!=(const handle& other) const;
+
+    private:
+      friend class quad_tree<Number, Object, BoundingBoxExtractor, Policy>::impl;
+
+      explicit handle(void* slot);
+
+      void* slot_ = nullptr;
+    };
+
     quad_tree() = default;
 
+    explicit quad_tree(memory_resource* resource); ///< resource has to outlive the tree
+
     ~quad_tree() = default;
 
     quad_tree(const quad_tree&) = delete;
@@ -81,6 +240,22 @@ namespace loose_quadtree {
     bool update(Object* object); ///< true if it was updated (else inserted)
     bool remove(Object* object); ///< true if it was removed
     bool contains(Object* object) const; ///< true if object is in tree
+    handle insert_with_handle(Object* object); ///< like insert, the same object always gets the same handle
+    void update(handle object_handle);
+    void remove(handle object_handle);
+    /// like insert, update and remove for each of the objects, the batch is sorted along a Z curve
+    /// first so the descents go through the tree in order and share the upper part of their ways
+    std::size_t insert_many(Object* const* objects, std::size_t count); ///< how many were inserted (else updated)
+    std::size_t update_many(Object* const* objects, std::size_t count); ///< how many were updated (else inserted)
+    std::size_t remove_many(Object* const* objects, std::size_t count); ///< how many were removed
+    /// replaces the contents with the objects, sized and sorted into the nodes from the top down
+    /// at the final depth, which is a lot faster than inserting them one by one
+    /// (insert_many into a tree without nodes builds it too)
+    void build(Object* const* objects, std::size_t count);
+    /// like build, the bounding boxes are extracted and the objects sorted into the quadrants
+    /// below the root by tasks of the executor (the BoundingBoxExtractor has to allow that),
+    /// only the nodes are made on the calling thread
+    void build(Object* const* objects, std::size_t count, const build_executor& executor);
     query query_intersects_region(const bounding_box<Number>& region);
 
     query query_inside_region(const bounding_box<Number>& region);
@@ -94,10 +269,36 @@ namespace loose_quadtree {
 
     bool is_empty() const;
 
+    void reserve(std::size_t objects); ///< makes room for finding that many objects without rehashing
+
+    /// makes the root cover these bounds (a square from their left top) right away, so inserts into
+    /// a fresh tree don't grow it step by step, and the root never shrinks below it (width 0 drops it)
+    void reserve_bounds(const bounding_box<Number>& bounds);
+
+    /// drops the roots above the contents which hold nothing but a single child, so queries start
+    /// closer to them (queries do it on their own, empty nodes are only cleaned up by queries)
+    void shrink_bounds();
+
+    /// growth of the bounding boxes on every side with the fat_bounding_boxes policy,
+    /// used by the objects inserted or leaving their fat boxes from now on
+    void set_fat_margin(Number margin);
+
+    Number get_fat_margin() const;
+
     void clear();
 
     void force_cleanup(); ///< does a full data structure and memory cleanup
     ///< cleanup is semi-automatic during queries so you needn't call this normally
+    ///< memory of a shared blocks_memory_resource is only given back by its release_free_blocks()
+
+    /// cleans up at most that many nodes, going on where the last call stopped: objects deeper than
+    /// the tree goes now move up, entries of objects removed during queries and empty nodes go,
+    /// nodes with a default_policy::node_capacity take their children back once they fit
+    /// (and split if they had to wait for it), as far as the running queries allow
+    /// (queries only clean up while no other one is running), true once a whole pass is done
+    bool maintain(std::size_t budget_nodes);
+
+    memory_stats get_memory_stats() const; ///< walks the whole tree
 
   private:
     impl impl_;
@@ -3,18 +3,39 @@
 
 #include "loose_quadtree/loose_quadtree.hpp"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <deque>
-#include <forward_list>
+#include <functional>
+#include <initializer_list>
 #include <limits>
-#include <map>
 #include <memory>
+#include <ratio>
+#include <thread>
 #include <unordered_map>
 #include <type_traits>
 #include <vector>
 
+#if !defined(LQT_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || \
+	(defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define LQT_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+#if !defined(LQT_NO_SIMD) && (defined(__SSE4_2__) || defined(__AVX2__))
+#define LQT_SIMD_SSE42
+#include <nmmintrin.h>
+#endif
+#if !defined(LQT_NO_SIMD) && defined(__AVX2__)
+#define LQT_SIMD_AVX2
+#include <immintrin.h>
+#endif
+
 namespace loose_quadtree {
 namespace detail {
 
@@ -22,21 +43,30 @@ namespace detail {
 
 #define LQT_USE_OWN_ALLOCATOR
 
-// TODO: Rewrite it
+// Pools small fixed-size objects in big blocks, one pool per size class.
+// Allocate and Deallocate are O(1): slots are threaded into a free list per
+// size class and no per-block bookkeeping is touched on the hot path. The
+// owning block of a slot is only needed when giving memory back, so
+// ReleaseFreeBlocks recovers it in bulk by sorting the blocks.
+// Reset forgets every allocation at once and keeps the blocks for reuse.
 class BlocksAllocator {
 public:
 	const static std::size_t kBlockAlign = alignof(long double);
 	const static std::size_t kBlockSize = 16384;
-	const static std::size_t kMaxAllowedAlloc = sizeof(void*) * 8;
+	const static std::size_t kMaxAllowedAlloc = sizeof(void*) * 32;
+	const static std::size_t kSizeClasses = kMaxAllowedAlloc / sizeof(void*);
 
 	BlocksAllocator();
 	~BlocksAllocator();
 	BlocksAllocator(const BlocksAllocator&) = delete;
 	BlocksAllocator& operator=(const BlocksAllocator&) = delete;
 
+	static bool IsPoolable(std::size_t object_size, std::size_t alignment);
 	void* Allocate(std::size_t object_size);
 	void Deallocate(void* p, std::size_t object_size);
 	void ReleaseFreeBlocks();
+	void Reset();
+	blocks_stats GetStats() const;
 	template <typename T, typename... Args>
 	T* New(Args&&... args);
 	template <typename T>
@@ -45,31 +75,27 @@ public:
 private:
 	using Block = std::aligned_storage<kBlockSize, kBlockAlign>::type;
 
-	//template <std::size_t kSizeT>
-	//union Slot {
-	//	Slot* next_empty_slot;
-	//	std::array<char, kSizeT> data;
-	//};
+	struct SizeClass {
+		std::vector<Block*> blocks;
+		std::size_t first_untouched_block; ///< blocks from here on were not used since a Reset
+		void* first_empty_slot; ///< free list threaded through the slots
+		char* untouched_begin; ///< never used slots of the newest block
+		char* untouched_end;
+		std::size_t live_slots;
 
-	using BlocksAndEmptySlots = std::map<Block*, std::size_t>;
-
-	struct BlocksHead {
-		BlocksAndEmptySlots address_to_empty_slot_number;
-		void* first_empty_slot;
-		std::size_t slots_in_a_block_;
-
-		BlocksHead(std::size_t object_size) {
-			first_empty_slot = nullptr;
-			slots_in_a_block_ = kBlockSize / object_size;
-		}
+		SizeClass() : first_untouched_block(0), first_empty_slot(nullptr),
+			untouched_begin(nullptr), untouched_end(nullptr), live_slots(0) {}
 	};
 
-	std::map<std::size_t, BlocksHead> size_to_blocks_;
+	static std::size_t SizeClassIndex(std::size_t object_size);
+	static std::size_t SlotSize(std::size_t size_class_index);
+
+	std::array<SizeClass, kSizeClasses> size_classes_;
 };
 
 
 template <typename T>
-struct BlocksAllocatorAdaptor {
+struct MemoryResourceAdaptor {
 	using value_type = T;
 	using pointer = T*;
 	using const_pointer = const T*;
@@ -78,17 +104,17 @@ struct BlocksAllocatorAdaptor {
 	using size_type = std::size_t;
 	using difference_type = std::ptrdiff_t;
 	template<typename U>
-	struct rebind {using other = BlocksAllocatorAdaptor<U>;};
+	struct rebind {using other = MemoryResourceAdaptor<U>;};
 
-	BlocksAllocatorAdaptor(BlocksAllocator& allocator);
+	MemoryResourceAdaptor(memory_resource* resource);
 	template <typename U>
-	BlocksAllocatorAdaptor(const BlocksAllocatorAdaptor<U>& other);
+	MemoryResourceAdaptor(const MemoryResourceAdaptor<U>& other);
 	template <typename U>
-	BlocksAllocatorAdaptor& operator=(const BlocksAllocatorAdaptor<U>& other);
+	MemoryResourceAdaptor& operator=(const MemoryResourceAdaptor<U>& other);
 
 	pointer address(reference r) const {return &r;}
 	const_pointer address(const_reference r) const {return &r;}
-	size_type max_size() const {return std::numeric_limits<size_type>::max();}
+	size_type max_size() const {return std::numeric_limits<size_type>::max() / sizeof(T);}
 	template <typename U, typename... Args>
 	void construct(U* p, Args&&... args) {
 		new((void*)p) U(std::forward<Args>(args)...);
@@ -101,67 +127,83 @@ struct BlocksAllocatorAdaptor {
 	T* allocate(std::size_t n);
 	void deallocate(T* p, std::size_t n);
 
-	BlocksAllocator* allocator_;
+	memory_resource* resource_;
 };
 
+template <typename T, typename U>
+bool operator==(const MemoryResourceAdaptor<T>& a, const MemoryResourceAdaptor<U>& b);
+template <typename T, typename U>
+bool operator!=(const MemoryResourceAdaptor<T>& a, const MemoryResourceAdaptor<U>& b);
 
-BlocksAllocator::BlocksAllocator() {}
+
+#ifndef LQT_USE_STD_PMR
+class NewDeleteResource : public memory_resource {
+private:
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+	void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override;
+	bool do_is_equal(const memory_resource& other) const noexcept override;
+};
+#endif
 
 
-BlocksAllocator::~BlocksAllocator() {
-	for (auto& size_block_pair : size_to_blocks_) {
-		BlocksHead& blocks_head = size_block_pair.second;
-		for (auto& address_empty_pair : blocks_head.address_to_empty_slot_number) {
-			assert(address_empty_pair.second == blocks_head.slots_in_a_block_);
-			Block* block = address_empty_pair.first;
+inline BlocksAllocator::BlocksAllocator() {}
+
+
+inline BlocksAllocator::~BlocksAllocator() {
+	for (SizeClass& size_class : size_classes_) {
+		assert(size_class.live_slots == 0);
+		for (Block* block : size_class.blocks) {
 			delete block;
 		}
 	}
 }
 
 
-void* BlocksAllocator::Allocate(std::size_t object_size) {
+inline std::size_t BlocksAllocator::SizeClassIndex(std::size_t object_size) {
+	return object_size == 0 ? 0 : (object_size - 1) / sizeof(void*);
+}
+
+
+inline std::size_t BlocksAllocator::SlotSize(std::size_t size_class_index) {
+	return (size_class_index + 1) * sizeof(void*);
+}
+
+
+inline bool BlocksAllocator::IsPoolable(std::size_t object_size, std::size_t alignment) {
+	return object_size <= kMaxAllowedAlloc && alignment <= kBlockAlign &&
+		SlotSize(SizeClassIndex(object_size)) % alignment == 0;
+}
+
+
+inline void* BlocksAllocator::Allocate(std::size_t object_size) {
 #ifdef LQT_USE_OWN_ALLOCATOR
-	if (object_size < sizeof(void*)) object_size = sizeof(void*);
 	assert(object_size <= kMaxAllowedAlloc);
-	auto size_blocks_it = size_to_blocks_.find(object_size);
-	if (size_blocks_it == size_to_blocks_.end()) {
-		size_blocks_it = size_to_blocks_.emplace(object_size, object_size).first;
-	}
-	BlocksHead& blocks_head = size_blocks_it->second;
-	assert(blocks_head.slots_in_a_block_ == kBlockSize / object_size);
-	if (blocks_head.first_empty_slot == nullptr) {
-		Block* new_block = new Block();
-		std::size_t empties = blocks_head.slots_in_a_block_;
-		blocks_head.address_to_empty_slot_number.emplace(new_block, empties);
-		blocks_head.first_empty_slot = reinterpret_cast<void*>(new_block);
-		void* current_slot = reinterpret_cast<void*>(new_block);
-		empties--;
-		while (empties > 0) {
-			void* next_slot =
-				reinterpret_cast<void*>(reinterpret_cast<char*>(current_slot)
-						+ object_size);
-			*reinterpret_cast<void**>(current_slot) = next_slot;
-			current_slot = next_slot;
-			empties--;
-		}
-		*reinterpret_cast<void**>(current_slot) = nullptr;
-	}
-	assert(blocks_head.first_empty_slot != nullptr);
-	void* slot = blocks_head.first_empty_slot;
-	blocks_head.first_empty_slot = *reinterpret_cast<void**>(slot);
-	auto address_empties_it =
-		blocks_head.address_to_empty_slot_number.upper_bound(reinterpret_cast<Block*>(slot));
-	assert(address_empties_it != blocks_head.address_to_empty_slot_number.begin());
-	address_empties_it--;
-	assert(address_empties_it->first <= reinterpret_cast<Block*>(slot) &&
-		(std::size_t)(reinterpret_cast<char*>(slot) -
-			reinterpret_cast<char*>(address_empties_it->first)) < kBlockSize);
-	assert((std::size_t)(reinterpret_cast<char*>(slot) -
-		reinterpret_cast<char*>(address_empties_it->first)) % object_size == 0);
-	assert(address_empties_it->second > 0 &&
-			address_empties_it->second <= blocks_head.slots_in_a_block_);
-	address_empties_it->second--;
+	std::size_t size_class_index = SizeClassIndex(object_size);
+	SizeClass& size_class = size_classes_[size_class_index];
+	void* slot = size_class.first_empty_slot;
+	if (slot != nullptr) {
+		size_class.first_empty_slot = *reinterpret_cast<void**>(slot);
+	}
+	else {
+		std::size_t slot_size = SlotSize(size_class_index);
+		if (size_class.untouched_begin == size_class.untouched_end) {
+			Block* new_block;
+			if (size_class.first_untouched_block < size_class.blocks.size()) {
+				new_block = size_class.blocks[size_class.first_untouched_block];
+			}
+			else {
+				new_block = new Block;
+				size_class.blocks.push_back(new_block);
+			}
+			size_class.first_untouched_block++;
+			size_class.untouched_begin = reinterpret_cast<char*>(new_block);
+			size_class.untouched_end = size_class.untouched_begin +
+				kBlockSize / slot_size * slot_size;
+		}
+		slot = reinterpret_cast<void*>(size_class.untouched_begin);
+		size_class.untouched_begin += slot_size;
+	}
+	size_class.live_slots++;
 	return slot;
 #else
 	return reinterpret_cast<void*>(new char[object_size]);
@@ -169,30 +211,14 @@ void* BlocksAllocator::Allocate(std::size_t object_size) {
 }
 
 
-void BlocksAllocator::Deallocate(void* p, std::size_t object_size) {
+inline void BlocksAllocator::Deallocate(void* p, std::size_t object_size) {
 #ifdef LQT_USE_OWN_ALLOCATOR
-	if (object_size < sizeof(void*)) object_size = sizeof(void*);
 	assert(object_size <= kMaxAllowedAlloc);
-	auto size_blocks_it = size_to_blocks_.find(object_size);
-	assert(size_blocks_it != size_to_blocks_.end());
-	BlocksHead& blocks_head = size_blocks_it->second;
-	assert(blocks_head.slots_in_a_block_ == kBlockSize / object_size);
-	auto address_empties_it =
-		blocks_head.address_to_empty_slot_number.upper_bound(reinterpret_cast<Block*>(p));
-	assert(address_empties_it != blocks_head.address_to_empty_slot_number.begin());
-	address_empties_it--;
-	assert(address_empties_it->first <= reinterpret_cast<Block*>(p) &&
-		(std::size_t)(reinterpret_cast<char*>(p) -
-			reinterpret_cast<char*>(address_empties_it->first)) < kBlockSize);
-	assert((std::size_t)(reinterpret_cast<char*>(p) -
-		reinterpret_cast<char*>(address_empties_it->first)) % object_size == 0);
-	assert(address_empties_it->second < blocks_head.slots_in_a_block_);
-	void* slot = p;
-	*reinterpret_cast<void**>(slot) = blocks_head.first_empty_slot;
-	blocks_head.first_empty_slot = slot;
-	address_empties_it->second++;
-	assert(address_empties_it->second > 0 &&
-			address_empties_it->second <= blocks_head.slots_in_a_block_);
+	SizeClass& size_class = size_classes_[SizeClassIndex(object_size)];
+	assert(size_class.live_slots > 0);
+	*reinterpret_cast<void**>(p) = size_class.first_empty_slot;
+	size_class.first_empty_slot = p;
+	size_class.live_slots--;
 #else
 	(void)object_size;
 	delete[] reinterpret_cast<char*>(p);
@@ -200,42 +226,113 @@ void BlocksAllocator::Deallocate(void* p, std::size_t object_size) {
 }
 
 
-void BlocksAllocator::ReleaseFreeBlocks() {
-	for (auto& size_block_pair : size_to_blocks_) {
-		BlocksHead& blocks_head = size_block_pair.second;
-		void** current = &blocks_head.first_empty_slot;
+inline void BlocksAllocator::ReleaseFreeBlocks() {
+	std::less<const void*> address_less;
+	for (std::size_t size_class_index = 0; size_class_index < kSizeClasses; size_class_index++) {
+		SizeClass& size_class = size_classes_[size_class_index];
+		if (size_class.live_slots == 0) {
+			for (Block* block : size_class.blocks) {
+				delete block;
+			}
+			size_class.blocks.clear();
+			size_class.first_untouched_block = 0;
+			size_class.first_empty_slot = nullptr;
+			size_class.untouched_begin = nullptr;
+			size_class.untouched_end = nullptr;
+			continue;
+		}
+
+		std::vector<Block*>& blocks = size_class.blocks;
+		for (std::size_t i = size_class.first_untouched_block; i < blocks.size(); i++) {
+			delete blocks[i];
+		}
+		blocks.resize(size_class.first_untouched_block);
+
+		std::size_t slot_size = SlotSize(size_class_index);
+		std::size_t slots_in_a_block = kBlockSize / slot_size;
+		// put the untouched slots on the free list so they are counted as well
+		while (size_class.untouched_begin != size_class.untouched_end) {
+			void* slot = reinterpret_cast<void*>(size_class.untouched_begin);
+			*reinterpret_cast<void**>(slot) = size_class.first_empty_slot;
+			size_class.first_empty_slot = slot;
+			size_class.untouched_begin += slot_size;
+		}
+
+		std::sort(blocks.begin(), blocks.end(), address_less);
+		auto owning_block = [&](void* slot) -> std::size_t {
+			auto it = std::upper_bound(blocks.begin(), blocks.end(), slot,
+				[&](const void* a, const Block* b) { return address_less(a, b); });
+			assert(it != blocks.begin());
+			it--;
+			assert((std::size_t)(reinterpret_cast<char*>(slot) -
+				reinterpret_cast<char*>(*it)) < kBlockSize);
+			assert((std::size_t)(reinterpret_cast<char*>(slot) -
+				reinterpret_cast<char*>(*it)) % slot_size == 0);
+			return (std::size_t)(it - blocks.begin());
+		};
+
+		std::vector<std::size_t> empty_slots(blocks.size(), 0);
+		for (void* slot = size_class.first_empty_slot; slot != nullptr;
+				slot = *reinterpret_cast<void**>(slot)) {
+			empty_slots[owning_block(slot)]++;
+		}
+
+		void** current = &size_class.first_empty_slot;
 		while (*current != nullptr) {
-			auto address_empties_it =
-				blocks_head.address_to_empty_slot_number.upper_bound(reinterpret_cast<Block*>(*current));
-			assert(address_empties_it != blocks_head.address_to_empty_slot_number.begin());
-			address_empties_it--;
-			assert(address_empties_it->first <= reinterpret_cast<Block*>(*current) &&
-				(std::size_t)(reinterpret_cast<char*>(*current) -
-					reinterpret_cast<char*>(address_empties_it->first)) < kBlockSize);
-			assert((std::size_t)(reinterpret_cast<char*>(*current) -
-				reinterpret_cast<char*>(address_empties_it->first)) % size_block_pair.first == 0);
-			assert(address_empties_it->second > 0 &&
-					address_empties_it->second <= blocks_head.slots_in_a_block_);
-			if (address_empties_it->second >= blocks_head.slots_in_a_block_) {
+			std::size_t block_index = owning_block(*current);
+			assert(empty_slots[block_index] > 0 &&
+				empty_slots[block_index] <= slots_in_a_block);
+			if (empty_slots[block_index] >= slots_in_a_block) {
 				*current = **reinterpret_cast<void***>(current);
 			}
 			else {
 				current = *reinterpret_cast<void***>(current);
 			}
 		}
-		auto address_empties_it = blocks_head.address_to_empty_slot_number.begin();
-		while (address_empties_it != blocks_head.address_to_empty_slot_number.end()) {
-			if (address_empties_it->second >= blocks_head.slots_in_a_block_) {
-				auto prev_address_empties_it = address_empties_it;
-				address_empties_it++;
-				delete prev_address_empties_it->first;
-				blocks_head.address_to_empty_slot_number.erase(prev_address_empties_it);
+
+		std::size_t kept = 0;
+		for (std::size_t i = 0; i < blocks.size(); i++) {
+			if (empty_slots[i] >= slots_in_a_block) {
+				delete blocks[i];
 			}
 			else {
-				address_empties_it++;
+				blocks[kept++] = blocks[i];
 			}
 		}
+		blocks.resize(kept);
+		size_class.first_untouched_block = kept;
+	}
+}
+
+
+inline void BlocksAllocator::Reset() {
+	for (SizeClass& size_class : size_classes_) {
+		size_class.first_untouched_block = 0;
+		size_class.first_empty_slot = nullptr;
+		size_class.untouched_begin = nullptr;
+		size_class.untouched_end = nullptr;
+		size_class.live_slots = 0;
+	}
+}
+
+
+inline blocks_stats BlocksAllocator::GetStats() const {
+	blocks_stats stats;
+	stats.block_size = kBlockSize;
+	for (std::size_t size_class_index = 0; size_class_index < kSizeClasses; size_class_index++) {
+		const SizeClass& size_class = size_classes_[size_class_index];
+		if (size_class.blocks.empty()) {
+			continue;
+		}
+		blocks_stats::size_class size_class_stats;
+		size_class_stats.slot_size = SlotSize(size_class_index);
+		size_class_stats.blocks = size_class.blocks.size();
+		size_class_stats.live_slots = size_class.live_slots;
+		size_class_stats.free_slots =
+			kBlockSize / size_class_stats.slot_size * size_class_stats.blocks - size_class.live_slots;
+		stats.size_classes.push_back(size_class_stats);
 	}
+	return stats;
 }
 
 
@@ -253,44 +350,62 @@ void BlocksAllocator::Delete(T* p) {
 
 
 template <typename T>
-BlocksAllocatorAdaptor<T>::BlocksAllocatorAdaptor(BlocksAllocator& allocator)
-	: allocator_(&allocator) {
+MemoryResourceAdaptor<T>::MemoryResourceAdaptor(memory_resource* resource)
+	: resource_(resource) {
 }
 
 template <typename T>
 template <typename U>
-BlocksAllocatorAdaptor<T>::BlocksAllocatorAdaptor(const BlocksAllocatorAdaptor<U>& other)
-	: allocator_(other.allocator_) {
+MemoryResourceAdaptor<T>::MemoryResourceAdaptor(const MemoryResourceAdaptor<U>& other)
+	: resource_(other.resource_) {
 }
 
 template <typename T>
 template <typename U>
-BlocksAllocatorAdaptor<T>&
-BlocksAllocatorAdaptor<T>::operator=(const BlocksAllocatorAdaptor<U>& other) {
-	allocator_ = other.allocator_;
+MemoryResourceAdaptor<T>&
+MemoryResourceAdaptor<T>::operator=(const MemoryResourceAdaptor<U>& other) {
+	resource_ = other.resource_;
+	return *this;
 }
 
 template <typename T>
-T* BlocksAllocatorAdaptor<T>::allocate(std::size_t n) {
-	if (sizeof(T) <= BlocksAllocator::kMaxAllowedAlloc && n == 1) {
-		return reinterpret_cast<T*>(allocator_->Allocate(sizeof(T)));
-	}
-	else {
-		return reinterpret_cast<T*>(new char[sizeof(T) * n]);
-	}
+T* MemoryResourceAdaptor<T>::allocate(std::size_t n) {
+	return reinterpret_cast<T*>(resource_->allocate(sizeof(T) * n, alignof(T)));
 }
 
 template <typename T>
-void BlocksAllocatorAdaptor<T>::deallocate(T* p, std::size_t n) {
-	if (sizeof(T) <= BlocksAllocator::kMaxAllowedAlloc && n == 1) {
-		allocator_->Deallocate(p, sizeof(T));
-	}
-	else {
-		delete[] reinterpret_cast<char*>(p);
-	}
+void MemoryResourceAdaptor<T>::deallocate(T* p, std::size_t n) {
+	resource_->deallocate(p, sizeof(T) * n, alignof(T));
+}
+
+template <typename T, typename U>
+bool operator==(const MemoryResourceAdaptor<T>& a, const MemoryResourceAdaptor<U>& b) {
+	return a.resource_ == b.resource_ || a.resource_->is_equal(*b.resource_);
+}
+
+template <typename T, typename U>
+bool operator!=(const MemoryResourceAdaptor<T>& a, const MemoryResourceAdaptor<U>& b) {
+	return !(a == b);
+}
+
+
+#ifndef LQT_USE_STD_PMR
+inline void* NewDeleteResource::do_allocate(std::size_t bytes, std::size_t alignment) {
+	assert(alignment <= alignof(std::max_align_t));
+	(void)alignment;
+	return ::operator new(bytes);
 }
 
+inline void NewDeleteResource::do_deallocate(void* p, std::size_t bytes, std::size_t alignment) {
+	(void)bytes;
+	(void)alignment;
+	::operator delete(p);
+}
 
+inline bool NewDeleteResource::do_is_equal(const memory_resource& other) const noexcept {
+	return this == &other;
+}
+#endif
 
 
 
@@ -307,193 +422,1056 @@ struct MakeDistance<double> { using Type = double;};
 template <>
 struct MakeDistance<long double> { using Type = long double;};
 
-
-
-enum class ChildPosition {
-	kNone,
-	kTopLeft,
-	kTopRight,
-	kBottomRight,
-	kBottomLeft,
+// A distance (never negative) times RatioT, rounded down for integral numbers,
+// which are divided first so the product does not overflow
+template <typename NumberT, typename RatioT, typename Enable = void>
+struct ScaleDistance {
+	static NumberT Apply(NumberT distance) {
+		return (NumberT)(distance * (NumberT)RatioT::num / (NumberT)RatioT::den);
+	}
 };
 
+template <typename NumberT, typename RatioT>
+struct ScaleDistance<NumberT, RatioT, typename std::enable_if<std::is_integral<NumberT>::value>::type> {
+	static NumberT Apply(NumberT distance) {
+		using Distance = typename MakeDistance<NumberT>::Type;
+		return (NumberT)((Distance)distance / RatioT::den * RatioT::num +
+			(Distance)distance % RatioT::den * RatioT::num / RatioT::den);
+	}
+};
 
 
-template <typename ObjectT>
-struct TreeNode {
-	using Object = ObjectT;
-	using ObjectContainer =
-		std::forward_list<Object*, BlocksAllocatorAdaptor<Object*>>;
 
-	TreeNode(BlocksAllocator& allocator) :
-		top_left(nullptr), top_right(nullptr), bottom_right(nullptr),
-		bottom_left(nullptr), objects(BlocksAllocatorAdaptor<Object*>(allocator))
-	{}
+// Tests of many cached bounding boxes against a query region at once.
+// The result is a hit mask, bit i stands for the box at index i.
+// SSE2 and AVX2 (SSE4.2 for 64 bit integers) are used when the compiler
+// targets them, everything else goes through the scalar kernel.
+// Define LQT_NO_SIMD to always use the scalar one.
 
-	TreeNode<Object>* top_left;
-	TreeNode<Object>* top_right;
-	TreeNode<Object>* bottom_right;
-	TreeNode<Object>* bottom_left;
-	ObjectContainer objects;
-};
+enum class BoxTest {kIntersects, kInside, kContains};
 
+const std::uint32_t kBoxTestBatch = 32; ///< boxes tested per call at most
 
+inline std::uint32_t CountTrailingZeros(std::uint32_t mask) {
+	assert(mask != 0);
+#if defined(__GNUC__) || defined(__clang__)
+	return (std::uint32_t)__builtin_ctz(mask);
+#else
+	std::uint32_t zeros = 0;
+	while ((mask & 1) == 0) {
+		mask >>= 1;
+		zeros++;
+	}
+	return zeros;
+#endif
+}
 
-template <typename NumberT, typename ObjectT>
-class ForwardTreeTraversal {
-public:
+template <typename NumberT>
+struct ScalarBoxKernel {
 	using Number = NumberT;
-	using Object = ObjectT;
 
-	struct TreePosition {
-		TreePosition(const bounding_box<Number>& _bbox, TreeNode<Object>* _node) :
-      bbox(_bbox), node(_node) {
-			current_child = ChildPosition::kNone;
+	static std::uint32_t Test(BoxTest test, const Number* lefts, const Number* tops,
+			const Number* widths, const Number* heights, std::uint32_t count,
+			const bounding_box<Number>& region) {
+		assert(count <= kBoxTestBatch);
+		std::uint32_t mask = 0;
+		for (std::uint32_t i = 0; i < count; i++) {
+			bounding_box<Number> box(lefts[i], tops[i], widths[i], heights[i]);
+			bool hit = false;
+			switch (test) {
+			case BoxTest::kIntersects:
+				hit = region.intersects(box);
+				break;
+			case BoxTest::kInside:
+				hit = region.contains(box);
+				break;
+			case BoxTest::kContains:
+				hit = box.contains(region);
+				break;
+			}
+			mask |= (std::uint32_t)hit << i;
 		}
+		return mask;
+	}
+};
 
-		bounding_box<Number> bbox;
-		TreeNode<Object>* node;
-		ChildPosition current_child;
-	};
-
-	ForwardTreeTraversal();
-	void StartAt(TreeNode<Object>* root, const bounding_box<Number>& root_bounds);
-	int GetDepth() const; ///< starting from 0
-	TreeNode<Object>* GetNode() const;
-	const bounding_box<Number>& GetNodeBoundingBox() const;
-	void GoTopLeft();
-	void GoTopRight();
-	void GoBottomRight();
-	void GoBottomLeft();
+// VectorT wraps one instruction set for one number type:
+// Load, Broadcast, Add, LessEqual (all bits set where true), And, Or and MoveMask
+template <typename NumberT, typename VectorT>
+struct SimdBoxKernel {
+	using Number = NumberT;
+	using Register = typename VectorT::Register;
+
+	static std::uint32_t Test(BoxTest test, const Number* lefts, const Number* tops,
+			const Number* widths, const Number* heights, std::uint32_t count,
+			const bounding_box<Number>& region) {
+		assert(count <= kBoxTestBatch);
+		const std::uint32_t lanes = VectorT::kLanes;
+		const std::uint32_t all_lanes = (1u << lanes) - 1;
+		Register region_left = VectorT::Broadcast(region.left);
+		Register region_top = VectorT::Broadcast(region.top);
+		Register region_right = VectorT::Broadcast((Number)(region.left + region.width));
+		Register region_bottom = VectorT::Broadcast((Number)(region.top + region.height));
+		std::uint32_t mask = 0;
+		std::uint32_t i = 0;
+		for (; i + lanes <= count; i += lanes) {
+			Register left = VectorT::Load(lefts + i);
+			Register top = VectorT::Load(tops + i);
+			Register right = VectorT::Add(left, VectorT::Load(widths + i));
+			Register bottom = VectorT::Add(top, VectorT::Load(heights + i));
+			std::uint32_t hits = 0;
+			switch (test) {
+			case BoxTest::kIntersects:
+				hits = ~VectorT::MoveMask(VectorT::Or(
+					VectorT::Or(VectorT::LessEqual(region_right, left), VectorT::LessEqual(right, region_left)),
+					VectorT::Or(VectorT::LessEqual(region_bottom, top), VectorT::LessEqual(bottom, region_top))))
+					& all_lanes;
+				break;
+			case BoxTest::kInside:
+				hits = VectorT::MoveMask(VectorT::And(
+					VectorT::And(VectorT::LessEqual(region_left, left), VectorT::LessEqual(right, region_right)),
+					VectorT::And(VectorT::LessEqual(region_top, top), VectorT::LessEqual(bottom, region_bottom))));
+				break;
+			case BoxTest::kContains:
+				hits = VectorT::MoveMask(VectorT::And(
+					VectorT::And(VectorT::LessEqual(left, region_left), VectorT::LessEqual(region_right, right)),
+					VectorT::And(VectorT::LessEqual(top, region_top), VectorT::LessEqual(region_bottom, bottom))));
+				break;
+			}
+			mask |= hits << i;
+		}
+		if (i < count) {
+			mask |= ScalarBoxKernel<Number>::Test(test, lefts + i, tops + i, widths + i, heights + i,
+				count - i, region) << i;
+		}
+		return mask;
+	}
+};
 
-protected:
-	TreePosition position_;
-	int depth_;
+#ifdef LQT_SIMD_SSE2
+struct Sse2Float {
+	using Register = __m128;
+	const static std::uint32_t kLanes = 4;
+	static Register Load(const float* p) {return _mm_loadu_ps(p);}
+	static Register Broadcast(float value) {return _mm_set1_ps(value);}
+	static Register Add(Register a, Register b) {return _mm_add_ps(a, b);}
+	static Register LessEqual(Register a, Register b) {return _mm_cmple_ps(a, b);}
+	static Register And(Register a, Register b) {return _mm_and_ps(a, b);}
+	static Register Or(Register a, Register b) {return _mm_or_ps(a, b);}
+	static std::uint32_t MoveMask(Register a) {return (std::uint32_t)_mm_movemask_ps(a);}
 };
 
+struct Sse2Double {
+	using Register = __m128d;
+	const static std::uint32_t kLanes = 2;
+	static Register Load(const double* p) {return _mm_loadu_pd(p);}
+	static Register Broadcast(double value) {return _mm_set1_pd(value);}
+	static Register Add(Register a, Register b) {return _mm_add_pd(a, b);}
+	static Register LessEqual(Register a, Register b) {return _mm_cmple_pd(a, b);}
+	static Register And(Register a, Register b) {return _mm_and_pd(a, b);}
+	static Register Or(Register a, Register b) {return _mm_or_pd(a, b);}
+	static std::uint32_t MoveMask(Register a) {return (std::uint32_t)_mm_movemask_pd(a);}
+};
 
+template <typename NumberT>
+struct Sse2Int32 {
+	using Register = __m128i;
+	const static std::uint32_t kLanes = 4;
+	static Register Load(const NumberT* p) {return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));}
+	static Register Broadcast(NumberT value) {return _mm_set1_epi32((std::int32_t)value);}
+	static Register Add(Register a, Register b) {return _mm_add_epi32(a, b);}
+	static Register LessEqual(Register a, Register b) {
+		return _mm_xor_si128(_mm_cmpgt_epi32(a, b), _mm_set1_epi32(-1));
+	}
+	static Register And(Register a, Register b) {return _mm_and_si128(a, b);}
+	static Register Or(Register a, Register b) {return _mm_or_si128(a, b);}
+	static std::uint32_t MoveMask(Register a) {return (std::uint32_t)_mm_movemask_ps(_mm_castsi128_ps(a));}
+};
+#endif
 
-template <typename NumberT, typename ObjectT>
-class FullTreeTraversal : public ForwardTreeTraversal<NumberT, ObjectT> {
-public:
-	using Number = NumberT;
-	using Object = ObjectT;
-	using typename ForwardTreeTraversal<Number, Object>::TreePosition;
+#ifdef LQT_SIMD_SSE42
+template <typename NumberT>
+struct Sse42Int64 {
+	using Register = __m128i;
+	const static std::uint32_t kLanes = 2;
+	static Register Load(const NumberT* p) {return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));}
+	static Register Broadcast(NumberT value) {return _mm_set1_epi64x((long long)value);}
+	static Register Add(Register a, Register b) {return _mm_add_epi64(a, b);}
+	static Register LessEqual(Register a, Register b) {
+		return _mm_xor_si128(_mm_cmpgt_epi64(a, b), _mm_set1_epi32(-1));
+	}
+	static Register And(Register a, Register b) {return _mm_and_si128(a, b);}
+	static Register Or(Register a, Register b) {return _mm_or_si128(a, b);}
+	static std::uint32_t MoveMask(Register a) {return (std::uint32_t)_mm_movemask_pd(_mm_castsi128_pd(a));}
+};
+#endif
 
-	void StartAt(TreeNode<Object>* root, const bounding_box<Number>& root_bounds);
-	ChildPosition GetNodeCurrentChild() const;
-	void SetNodeCurrentChild(ChildPosition child_position);
-	void GoUp();
-	void GoTopLeft();
-	void GoTopRight();
-	void GoBottomRight();
-	void GoBottomLeft();
+#ifdef LQT_SIMD_AVX2
+struct Avx2Float {
+	using Register = __m256;
+	const static std::uint32_t kLanes = 8;
+	static Register Load(const float* p) {return _mm256_loadu_ps(p);}
+	static Register Broadcast(float value) {return _mm256_set1_ps(value);}
+	static Register Add(Register a, Register b) {return _mm256_add_ps(a, b);}
+	static Register LessEqual(Register a, Register b) {return _mm256_cmp_ps(a, b, _CMP_LE_OQ);}
+	static Register And(Register a, Register b) {return _mm256_and_ps(a, b);}
+	static Register Or(Register a, Register b) {return _mm256_or_ps(a, b);}
+	static std::uint32_t MoveMask(Register a) {return (std::uint32_t)_mm256_movemask_ps(a);}
+};
 
-private:
-	using ForwardTreeTraversal<Number, Object>::position_;
-	using ForwardTreeTraversal<Number, Object>::depth_;
+struct Avx2Double {
+	using Register = __m256d;
+	const static std::uint32_t kLanes = 4;
+	static Register Load(const double* p) {return _mm256_loadu_pd(p);}
+	static Register Broadcast(double value) {return _mm256_set1_pd(value);}
+	static Register Add(Register a, Register b) {return _mm256_add_pd(a, b);}
+	static Register LessEqual(Register a, Register b) {return _mm256_cmp_pd(a, b, _CMP_LE_OQ);}
+	static Register And(Register a, Register b) {return _mm256_and_pd(a, b);}
+	static Register Or(Register a, Register b) {return _mm256_or_pd(a, b);}
+	static std::uint32_t MoveMask(Register a) {return (std::uint32_t)_mm256_movemask_pd(a);}
+};
 
-	std::vector<TreePosition> position_stack_;
+template <typename NumberT>
+struct Avx2Int32 {
+	using Register = __m256i;
+	const static std::uint32_t kLanes = 8;
+	static Register Load(const NumberT* p) {return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));}
+	static Register Broadcast(NumberT value) {return _mm256_set1_epi32((std::int32_t)value);}
+	static Register Add(Register a, Register b) {return _mm256_add_epi32(a, b);}
+	static Register LessEqual(Register a, Register b) {
+		return _mm256_xor_si256(_mm256_cmpgt_epi32(a, b), _mm256_set1_epi32(-1));
+	}
+	static Register And(Register a, Register b) {return _mm256_and_si256(a, b);}
+	static Register Or(Register a, Register b) {return _mm256_or_si256(a, b);}
+	static std::uint32_t MoveMask(Register a) {return (std::uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(a));}
 };
 
+template <typename NumberT>
+struct Avx2Int64 {
+	using Register = __m256i;
+	const static std::uint32_t kLanes = 4;
+	static Register Load(const NumberT* p) {return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));}
+	static Register Broadcast(NumberT value) {return _mm256_set1_epi64x((long long)value);}
+	static Register Add(Register a, Register b) {return _mm256_add_epi64(a, b);}
+	static Register LessEqual(Register a, Register b) {
+		return _mm256_xor_si256(_mm256_cmpgt_epi64(a, b), _mm256_set1_epi32(-1));
+	}
+	static Register And(Register a, Register b) {return _mm256_and_si256(a, b);}
+	static Register Or(Register a, Register b) {return _mm256_or_si256(a, b);}
+	static std::uint32_t MoveMask(Register a) {return (std::uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(a));}
+};
+#endif
 
+// Picks the widest kernel available for a number type
+template <typename NumberT, typename Enable = void>
+struct BoxKernel {
+	using Type = ScalarBoxKernel<NumberT>;
+};
 
-} //detail
+#if defined(LQT_SIMD_AVX2)
+template <>
+struct BoxKernel<float> {
+	using Type = SimdBoxKernel<float, Avx2Float>;
+};
 
+template <>
+struct BoxKernel<double> {
+	using Type = SimdBoxKernel<double, Avx2Double>;
+};
+#elif defined(LQT_SIMD_SSE2)
+template <>
+struct BoxKernel<float> {
+	using Type = SimdBoxKernel<float, Sse2Float>;
+};
 
+template <>
+struct BoxKernel<double> {
+	using Type = SimdBoxKernel<double, Sse2Double>;
+};
+#endif
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-class
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::
-Impl {
-public:
-	enum class QueryType {kIntersects, kInside, kContains, kEndOfQuery};
+#if defined(LQT_SIMD_AVX2) || defined(LQT_SIMD_SSE2)
+template <typename NumberT>
+struct BoxKernel<NumberT, typename std::enable_if<std::is_integral<NumberT>::value &&
+		std::is_signed<NumberT>::value && sizeof(NumberT) == 4>::type> {
+#ifdef LQT_SIMD_AVX2
+	using Type = SimdBoxKernel<NumberT, Avx2Int32<NumberT>>;
+#else
+	using Type = SimdBoxKernel<NumberT, Sse2Int32<NumberT>>;
+#endif
+};
+#endif
 
-	Impl();
-	void Acquire(typename quad_tree<Number, Object, BoundingBoxExtractor>::impl* quadtree,
-               const bounding_box<Number>* query_region, QueryType query_type);
-	void Release();
-	bool IsAvailable() const;
-	bool end_of_query() const;
-	Object* GetCurrent() const;
-	void Next();
+#if defined(LQT_SIMD_AVX2) || defined(LQT_SIMD_SSE42)
+template <typename NumberT>
+struct BoxKernel<NumberT, typename std::enable_if<std::is_integral<NumberT>::value &&
+		std::is_signed<NumberT>::value && sizeof(NumberT) == 8>::type> {
+#ifdef LQT_SIMD_AVX2
+	using Type = SimdBoxKernel<NumberT, Avx2Int64<NumberT>>;
+#else
+	using Type = SimdBoxKernel<NumberT, Sse42Int64<NumberT>>;
+#endif
+};
+#endif
 
-private:
-	enum class FitType {kNoFit = 0, kPartialFit, kFreeRide};
 
-	bool CurrentObjectFits() const;
-	FitType CurrentNodeFits() const;
 
-	typename quad_tree<Number, Object, BoundingBoxExtractor>::impl* quadtree_;
-	detail::FullTreeTraversal<Number, Object> traversal_;
-	typename detail::TreeNode<Object>::ObjectContainer::iterator object_iterator_;
-	typename detail::TreeNode<Object>::ObjectContainer::iterator object_iterator_before_;
-	bounding_box<Number> query_region_;
-	QueryType query_type_;
-	int free_ride_from_level_;
+enum class ChildPosition {
+	kNone,
+	kTopLeft,
+	kTopRight,
+	kBottomRight,
+	kBottomLeft,
 };
 
 
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-class
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::
-impl {
-public:
-	constexpr static int kInternalMinDepth = 4;
-	constexpr static int kInternalMaxDepth = (sizeof(long long) * 8 - 1) / 2;
-	constexpr static Number kMinimalObjectExtent =
-		std::is_integral<Number>::value ? 1 :
-			std::numeric_limits<Number>::min() * 16;
+// Where an object is stored, so it can be found without a search.
+// Kept up to date when entries of a bucket are moved.
+template <typename NodeT>
+struct ObjectSlot {
+	typename NodeT::Link node;
+	std::uint32_t index;
+};
 
-	impl();
-	~impl();
-	impl(const impl&) = delete;
-	impl& operator=(const impl&) = delete;
+// The objects the descent puts into a node: centers in [left, right) x [top, bottom)
+// and maximal extents in (minimal_extent, maximal_extent], or only up to maximal_extent
+// at the maximal depth. The sides are the centers the descent compared against on its
+// way down, so the answer is exactly the one of a descent without taking it.
+// With cache_node_cells every object slot keeps the cell of its node.
+template <typename NumberT>
+struct NodeCell {
+	/// the descent goes through the node, maybe deeper (the cell of a node it has not left yet)
+	bool Leads(NumberT center_x, NumberT center_y, NumberT extent, std::uint32_t tree_root_growths) const {
+		return root_growths == tree_root_growths &&
+			left <= center_x && center_x < right && top <= center_y && center_y < bottom &&
+			extent <= maximal_extent;
+	}
+	bool Admits(NumberT center_x, NumberT center_y, NumberT extent,
+			int maximal_depth, std::uint32_t tree_root_growths) const {
+		return root_growths == tree_root_growths &&
+			left <= center_x && center_x < right && top <= center_y && center_y < bottom &&
+			extent <= maximal_extent && depth <= maximal_depth &&
+			(extent > minimal_extent || depth == maximal_depth);
+	}
 
-	bool Insert(Object* object);
-	bool Update(Object* object);
-	bool Remove(Object* object);
-	bool Contains(Object* object) const;
-	query QueryIntersectsRegion(const bounding_box<Number>& region);
-	query QueryInsideRegion(const bounding_box<Number>& region);
-	query QueryContainsRegion(const bounding_box<Number>& region);
-	const bounding_box<Number>& GetBoundingBox() const; ///< loose sense bounds
-	int GetSize() const;
-	void Clear();
-	void ForceCleanup();
+	NumberT left;
+	NumberT top;
+	NumberT right;
+	NumberT bottom;
+	NumberT minimal_extent; ///< what the children take, smaller objects go deeper
+	NumberT maximal_extent; ///< what the node takes, larger objects stay above
+	int depth;
+	std::uint32_t root_growths; ///< of the tree when it was made, every growth makes it stale
+};
 
-private:
-	friend class query::Impl;
-	using ObjectPointerContainer =
-		std::unordered_map<Object*, Object**,
-		std::hash<Object*>, std::equal_to<Object*>,
-		detail::BlocksAllocatorAdaptor<std::pair<Object *const, Object**>>>;
-	using QueryPoolContainer =
-		std::deque<typename quad_tree<Number, Object, BoundingBoxExtractor>::query::Impl>;
+// The cell of slots without cells, empty and admitting nothing
+template <typename NumberT>
+struct NoNodeCell {
+	NoNodeCell& operator=(const NodeCell<NumberT>&) {
+		return *this;
+	}
+	bool Admits(NumberT, NumberT, NumberT, int, std::uint32_t) const {
+		return false;
+	}
+};
 
-	void RecalculateMaximalDepth();
-	void DeleteTree();
-	Object** InsertIntoTree(Object* object);
-	typename query::Impl* GetAvailableQueryFromPool();
+// The box an object was placed by with fat_bounding_boxes, its bounding box grown
+// by the margin of the tree. The object stays put while its bounding box is inside.
+template <typename NumberT>
+struct FatBoundingBox {
+	FatBoundingBox() : bounds(0, 0, 0, 0) {}
+	explicit FatBoundingBox(const bounding_box<NumberT>& fat_bounds) : bounds(fat_bounds) {}
 
-	detail::BlocksAllocator allocator_;
-	detail::TreeNode<Object>* root_;
-	bounding_box<Number> bounding_box_;
-	ObjectPointerContainer object_pointers_;
-	int number_of_objects_;
-	int maximal_depth_;
-	detail::FullTreeTraversal<Number, Object> internal_traversal_;
-	QueryPoolContainer query_pool_;
-	int running_queries_; ///< queries which are opened and not at their end
+	bool Contains(const bounding_box<NumberT>& object_bounds) const {
+		return bounds.contains(object_bounds);
+	}
+
+	bounding_box<NumberT> bounds;
 };
 
+// The fat box of slots without one, empty and containing nothing
+template <typename NumberT>
+struct NoFatBoundingBox {
+	NoFatBoundingBox& operator=(const FatBoundingBox<NumberT>&) {
+		return *this;
+	}
+	bool Contains(const bounding_box<NumberT>&) const {
+		return false;
+	}
+};
 
+// The bits of the lower 24 bits of x and y interleaved, y taking the upper one of each pair.
+// Sorting by it puts the objects of a batch along a Z curve, the order of a depth first walk.
+inline std::uint64_t InterleaveBits(std::uint32_t x, std::uint32_t y) {
+	std::uint64_t spread[2] = {x & 0xffffffu, y & 0xffffffu};
+	for (std::uint64_t& bits : spread) {
+		bits = (bits | (bits << 16)) & 0x0000ffff0000ffffull;
+		bits = (bits | (bits << 8)) & 0x00ff00ff00ff00ffull;
+		bits = (bits | (bits << 4)) & 0x0f0f0f0f0f0f0f0full;
+		bits = (bits | (bits << 2)) & 0x3333333333333333ull;
+		bits = (bits | (bits << 1)) & 0x5555555555555555ull;
+	}
+	return spread[0] | (spread[1] << 1);
+}
 
+// The objects of a node in a single allocation laid out as arrays:
+// objects[capacity], slots[capacity] and, if the tree caches them,
+// the lefts, tops, widths and heights of the bounding boxes.
+// A nullptr object is the tombstone of an object removed during a query.
+template <typename ObjectT, typename NodeT>
+struct ObjectBucket {
+	using Object = ObjectT;
 
+	ObjectBucket() : data(nullptr), size(0), capacity(0) {}
 
+	Object** Objects() const {
+		return reinterpret_cast<Object**>(data);
+	}
+	ObjectSlot<NodeT>** Slots() const {
+		return reinterpret_cast<ObjectSlot<NodeT>**>(Objects() + capacity);
+	}
+	bool Empty() const {
+		return size == 0;
+	}
 
-template <typename NumberT>
+	void* data;
+	std::uint32_t size;
+	std::uint32_t capacity;
+};
+
+// The bounding boxes of the objects of a bucket sorted by their left sides, for the queries
+// of large buckets to test them without extracting every one. A region takes the entries
+// from the widest box left of it on up to its right side and tests them as they lie.
+template <typename NumberT>
+class SortedBoxIndex {
+public:
+	using Number = NumberT;
+
+	explicit SortedBoxIndex(memory_resource* resource);
+
+	void Clear();
+	void Add(const bounding_box<Number>& bounds, std::uint32_t index); ///< in any order, sorted by Sort
+	void Sort();
+	/// sets the bit of the index of every box touching the region, its edges included,
+	/// which covers any box an intersects, inside or contains test of the region passes
+	void MarkTouching(const bounding_box<Number>& region, std::uint32_t* bits) const;
+
+private:
+	struct Entry {
+		Number left;
+		Number top;
+		Number width;
+		Number height;
+		std::uint32_t index;
+	};
+
+	std::vector<Entry, MemoryResourceAdaptor<Entry>> entries_;
+	Number widest_; ///< boxes starting farther left than that from a region miss it
+};
+
+// A missing child is a Link() in both kinds of nodes
+template <typename ObjectT>
+struct TreeNode {
+	using Object = ObjectT;
+	using Link = TreeNode<Object>*;
+
+	TreeNode() :
+		top_left(nullptr), top_right(nullptr), bottom_right(nullptr),
+		bottom_left(nullptr)
+	{}
+
+	TreeNode<Object>* top_left;
+	TreeNode<Object>* top_right;
+	TreeNode<Object>* bottom_right;
+	TreeNode<Object>* bottom_left;
+	ObjectBucket<Object, TreeNode<Object>> objects;
+};
+
+template <typename ObjectT>
+struct CompactTreeNode {
+	using Object = ObjectT;
+	using Link = std::uint32_t;
+
+	CompactTreeNode() :
+		top_left(0), top_right(0), bottom_right(0), bottom_left(0)
+	{}
+
+	std::uint32_t top_left;
+	std::uint32_t top_right;
+	std::uint32_t bottom_right;
+	std::uint32_t bottom_left;
+	ObjectBucket<Object, CompactTreeNode<Object>> objects;
+};
+
+
+
+// Nodes allocated one by one, linked by pointers
+template <typename ObjectT>
+class PointerNodePool {
+public:
+	using Node = TreeNode<ObjectT>;
+	using Link = typename Node::Link;
+
+	explicit PointerNodePool(memory_resource* resource);
+	PointerNodePool(const PointerNodePool&) = delete;
+	PointerNodePool& operator=(const PointerNodePool&) = delete;
+
+	static Node* Resolve(const PointerNodePool<ObjectT>* pool, Link link); ///< pool is not needed
+	Link New();
+	void Delete(Link link);
+	void Reset(); ///< forgets all nodes, their memory is reset along with the resource
+
+private:
+	memory_resource* resource_;
+};
+
+
+
+// Nodes in big chunks addressed by 32 bit indices, which makes the nodes and
+// the object slots smaller. Index 0 stands for no node.
+template <typename ObjectT>
+class CompactNodePool {
+public:
+	using Node = CompactTreeNode<ObjectT>;
+	using Link = typename Node::Link;
+
+	const static std::uint32_t kChunkShift = 8;
+	const static std::uint32_t kChunkNodes = 1u << kChunkShift;
+
+	explicit CompactNodePool(memory_resource* resource);
+	~CompactNodePool();
+	CompactNodePool(const CompactNodePool&) = delete;
+	CompactNodePool& operator=(const CompactNodePool&) = delete;
+
+	static Node* Resolve(const CompactNodePool<ObjectT>* pool, Link link);
+	Link New();
+	void Delete(Link link);
+	void Reset(); ///< forgets all nodes, keeps the chunks
+
+private:
+	std::vector<Node*, MemoryResourceAdaptor<Node*>> chunks_;
+	memory_resource* resource_;
+	Link first_free_; ///< free nodes are linked through top_left
+	Link first_unused_;
+};
+
+
+
+// Finds the slots of the objects through a hash map
+template <typename ObjectT, typename SlotT>
+class ObjectSlotMap {
+public:
+	using Object = ObjectT;
+	using Slot = SlotT;
+	constexpr static bool kStoredInObjects = false;
+
+	explicit ObjectSlotMap(memory_resource* resource) :
+		map_(64, std::hash<Object*>(), std::equal_to<Object*>(),
+			MemoryResourceAdaptor<std::pair<Object* const, Slot*>>(resource)) {}
+
+	Slot* Find(Object* object) const {
+		auto it = map_.find(object);
+		return it != map_.end() ? it->second : nullptr;
+	}
+	void Insert(Object* object, Slot* slot) {
+		map_.emplace(object, slot);
+	}
+	void Erase(Object* object) {
+		std::size_t erased = map_.erase(object);
+		assert(erased == 1);
+		(void)erased;
+	}
+	void Forget(Object*) {} ///< Clear does it at once
+	void Clear() {
+		map_.clear();
+	}
+	void Reserve(std::size_t size) {
+		// reserving less than there is room for could shrink the buckets
+		if (size > map_.bucket_count() * map_.max_load_factor()) {
+			map_.reserve(size);
+		}
+	}
+	std::size_t GetBucketCount() const {
+		return map_.bucket_count();
+	}
+	std::size_t GetBytes() const {
+		// buckets plus one node per entry holding the next pointer and the value
+		return map_.bucket_count() * sizeof(void*) +
+			map_.size() * (sizeof(void*) + sizeof(typename Map::value_type));
+	}
+
+private:
+	using Map = std::unordered_map<Object*, Slot*, std::hash<Object*>, std::equal_to<Object*>,
+		MemoryResourceAdaptor<std::pair<Object* const, Slot*>>>;
+
+	Map map_;
+};
+
+
+
+// Finds the slots of the objects through an open addressing table with linear probing,
+// removal shifts the following entries back instead of leaving tombstones
+template <typename ObjectT, typename SlotT>
+class ObjectSlotFlatMap {
+public:
+	using Object = ObjectT;
+	using Slot = SlotT;
+	constexpr static bool kStoredInObjects = false;
+
+	explicit ObjectSlotFlatMap(memory_resource* resource);
+	~ObjectSlotFlatMap();
+	ObjectSlotFlatMap(const ObjectSlotFlatMap&) = delete;
+	ObjectSlotFlatMap& operator=(const ObjectSlotFlatMap&) = delete;
+
+	Slot* Find(Object* object) const;
+	void Insert(Object* object, Slot* slot);
+	void Erase(Object* object);
+	void Forget(Object*) {} ///< Clear does it at once
+	void Clear();
+	void Reserve(std::size_t size);
+	std::size_t GetBucketCount() const;
+	std::size_t GetBytes() const;
+
+private:
+	struct Entry {
+		Object* object; ///< nullptr for an empty entry
+		Slot* slot;
+	};
+
+	std::size_t GetHome(Object* object) const;
+	void Rehash(std::size_t capacity);
+
+	memory_resource* resource_;
+	Entry* entries_;
+	std::size_t capacity_; ///< zero or a power of two
+	std::size_t size_;
+	int shift_; ///< of the hash to get an index
+};
+
+
+
+// Finds the slots of the objects through the object_hook in them
+template <typename ObjectT, typename SlotT, typename HookExtractorT>
+class ObjectSlotHooks {
+public:
+	using Object = ObjectT;
+	using Slot = SlotT;
+	constexpr static bool kStoredInObjects = true;
+
+	explicit ObjectSlotHooks(memory_resource*) {}
+
+	Slot* Find(Object* object) const {
+		return static_cast<Slot*>(HookExtractorT::ExtractObjectHook(object)->slot);
+	}
+	void Insert(Object* object, Slot* slot) {
+		assert(Find(object) == nullptr); // in a single tree per hook
+		HookExtractorT::ExtractObjectHook(object)->slot = slot;
+	}
+	void Erase(Object* object) {
+		Forget(object);
+	}
+	void Forget(Object* object) {
+		HookExtractorT::ExtractObjectHook(object)->slot = nullptr;
+	}
+	void Clear() {} ///< the objects have to be forgotten one by one
+	void Reserve(std::size_t) {}
+	std::size_t GetBucketCount() const {
+		return 0;
+	}
+	std::size_t GetBytes() const {
+		return 0;
+	}
+};
+
+
+
+template <typename NumberT, typename ObjectT, typename NodePoolT = PointerNodePool<ObjectT>>
+class ForwardTreeTraversal {
+public:
+	using Number = NumberT;
+	using Object = ObjectT;
+	using NodePool = NodePoolT;
+	using Node = typename NodePool::Node;
+
+	struct TreePosition {
+		TreePosition(const bounding_box<Number>& _bbox, Node* _node) :
+      bbox(_bbox), node(_node) {
+			current_child = ChildPosition::kNone;
+		}
+
+		bounding_box<Number> bbox;
+		Node* node;
+		ChildPosition current_child;
+	};
+
+	ForwardTreeTraversal();
+	void StartAt(Node* root, const bounding_box<Number>& root_bounds,
+		const NodePool* pool = nullptr);
+	int GetDepth() const; ///< starting from 0
+	Node* GetNode() const;
+	const bounding_box<Number>& GetNodeBoundingBox() const;
+	static bounding_box<Number> GetChildBoundingBox(const bounding_box<Number>& bbox,
+		ChildPosition child_position);
+	void GoTopLeft();
+	void GoTopRight();
+	void GoBottomRight();
+	void GoBottomLeft();
+
+protected:
+	TreePosition position_;
+	int depth_;
+	const NodePool* pool_;
+};
+
+
+
+template <typename NumberT, typename ObjectT, typename NodePoolT = PointerNodePool<ObjectT>>
+class FullTreeTraversal : public ForwardTreeTraversal<NumberT, ObjectT, NodePoolT> {
+public:
+	using Number = NumberT;
+	using Object = ObjectT;
+	using NodePool = NodePoolT;
+	using typename ForwardTreeTraversal<Number, Object, NodePool>::Node;
+	using typename ForwardTreeTraversal<Number, Object, NodePool>::TreePosition;
+
+	void StartAt(Node* root, const bounding_box<Number>& root_bounds,
+		const NodePool* pool = nullptr);
+	ChildPosition GetNodeCurrentChild() const;
+	void SetNodeCurrentChild(ChildPosition child_position);
+	void GoUp();
+	void GoTopLeft();
+	void GoTopRight();
+	void GoBottomRight();
+	void GoBottomLeft();
+
+private:
+	using ForwardTreeTraversal<Number, Object, NodePool>::position_;
+	using ForwardTreeTraversal<Number, Object, NodePool>::depth_;
+
+	std::vector<TreePosition> position_stack_;
+};
+
+
+
+} //detail
+
+
+
+class blocks_memory_resource : public memory_resource {
+public:
+	explicit blocks_memory_resource(memory_resource* upstream = new_delete_resource());
+	~blocks_memory_resource();
+	blocks_memory_resource(const blocks_memory_resource&) = delete;
+	blocks_memory_resource& operator=(const blocks_memory_resource&) = delete;
+
+	memory_resource* upstream_resource() const;
+	void release_free_blocks(); ///< gives fully empty blocks back to the system
+	void reset(); ///< frees everything at once, nothing allocated before may be touched again
+	blocks_stats get_stats() const;
+
+private:
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+	void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override;
+	bool do_is_equal(const memory_resource& other) const noexcept override;
+
+	// Header in front of every allocation passed to the upstream resource,
+	// they are linked together so reset can free them as well
+	struct UpstreamAllocation {
+		UpstreamAllocation* previous;
+		UpstreamAllocation* next;
+		std::size_t bytes;
+		std::size_t alignment;
+	};
+
+	static std::size_t UpstreamHeaderSize(std::size_t alignment);
+	static std::size_t UpstreamAlignment(std::size_t alignment);
+	void DeallocateUpstream(UpstreamAllocation* allocation);
+	void ReleaseUpstreamAllocations();
+
+	detail::BlocksAllocator allocator_;
+	memory_resource* upstream_;
+	UpstreamAllocation upstream_allocations_; ///< list head
+	std::size_t upstream_allocation_count_;
+	std::size_t upstream_bytes_;
+};
+
+
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+class
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::
+Impl {
+public:
+	enum class QueryType {kIntersects, kInside, kContains, kEndOfQuery};
+
+	Impl();
+	void Acquire(typename quad_tree<Number, Object, BoundingBoxExtractor, Policy>::impl* quadtree,
+               const bounding_box<Number>* query_region, QueryType query_type);
+	void Release();
+	bool IsAvailable() const;
+	bool end_of_query() const;
+	Object* GetCurrent() const;
+	void Next();
+
+private:
+	enum class FitType {kNoFit = 0, kPartialFit, kFreeRide};
+	using NodePool = typename std::conditional<Policy::compact_nodes,
+		detail::CompactNodePool<Object>, detail::PointerNodePool<Object>>::type;
+	using Node = typename NodePool::Node;
+	using Link = typename NodePool::Link;
+	using Bucket = detail::ObjectBucket<Object, Node>;
+
+public:
+	bool IsReading(const Node* node) const; ///< the objects of the node, only while running
+
+private:
+	void SeekFittingObject(); ///< from the current object on
+	bool CurrentObjectFits() const;
+	std::uint32_t NextCachedHit(); ///< tests the cached boxes in batches, tombstones count as hits
+	void MarkIndexedHits(); ///< of the node just entered if its bucket is worth an index
+	std::uint32_t NextIndexedHit(); ///< the current entry once the index is stale
+	void MoveIndexedHit(std::uint32_t from, std::uint32_t to);
+	FitType CurrentNodeFits() const;
+
+	typename quad_tree<Number, Object, BoundingBoxExtractor, Policy>::impl* quadtree_;
+	detail::FullTreeTraversal<Number, Object, NodePool> traversal_;
+	std::uint32_t object_index_; ///< in the bucket of the current node
+	std::uint32_t hit_mask_; ///< bit i for the entry at hit_mask_begin_ + i
+	std::uint32_t hit_mask_begin_;
+	std::uint32_t hit_mask_end_; ///< zero if there is no valid mask
+	std::uint32_t hit_mask_modifications_; ///< of the tree when the mask was made
+	std::vector<std::uint32_t> indexed_hits_; ///< a bit per entry of the current node, empty without an index
+	std::uint32_t indexed_hits_modifications_;
+	bounding_box<Number> query_region_;
+	QueryType query_type_;
+	int free_ride_from_level_; ///< deeper than any node if there is none
+};
+
+
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+class
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+impl {
+public:
+	constexpr static int kInternalMaxDepth = (sizeof(long long) * 8 - 1) / 2;
+	static_assert(Policy::minimal_depth >= 0 && Policy::minimal_depth <= Policy::maximal_depth &&
+		Policy::maximal_depth <= kInternalMaxDepth, "the depths of the policy are out of range");
+	/// maximal_depth_ of an empty tree, which stays there if the nodes split by their contents
+	constexpr static int kStartDepth =
+		Policy::node_capacity > 0 ? Policy::maximal_depth : Policy::minimal_depth;
+	static_assert(std::ratio_greater<typename Policy::looseness, std::ratio<1>>::value &&
+		std::ratio_less_equal<typename Policy::looseness, std::ratio<2>>::value,
+		"the looseness of the policy is out of range");
+	/// the largest object a node takes per its size, as far as its objects reach out of it on both sides
+	using LooseReach = std::ratio_subtract<typename Policy::looseness, std::ratio<1>>;
+	constexpr static Number kMinimalObjectExtent =
+		std::is_integral<Number>::value ? 1 :
+			std::numeric_limits<Number>::min() * 16;
+
+	impl();
+	explicit impl(memory_resource* resource);
+	~impl();
+	impl(const impl&) = delete;
+	impl& operator=(const impl&) = delete;
+
+	bool Insert(Object* object);
+	bool Update(Object* object);
+	bool Remove(Object* object);
+	bool Contains(Object* object) const;
+	handle InsertWithHandle(Object* object);
+	void Update(handle object_handle);
+	void Remove(handle object_handle);
+	std::size_t InsertMany(Object* const* objects, std::size_t count); ///< returns how many were inserted
+	std::size_t RemoveMany(Object* const* objects, std::size_t count);
+	void Build(Object* const* objects, std::size_t count,
+		const build_executor* executor = nullptr); ///< single-threaded without an executor
+	query QueryIntersectsRegion(const bounding_box<Number>& region);
+	query QueryInsideRegion(const bounding_box<Number>& region);
+	query QueryContainsRegion(const bounding_box<Number>& region);
+	const bounding_box<Number>& GetBoundingBox() const; ///< loose sense bounds
+	int GetSize() const;
+	void Reserve(std::size_t objects);
+	void ReserveBounds(const bounding_box<Number>& bounds);
+	void ShrinkBounds();
+	bool Maintain(std::size_t budget_nodes); ///< true at the end of a pass
+	void SetFatMargin(Number margin);
+	Number GetFatMargin() const;
+	void Clear();
+	void ForceCleanup();
+	memory_stats GetMemoryStats() const;
+
+private:
+	friend class query::Impl;
+	using NodePool = typename std::conditional<Policy::compact_nodes,
+		detail::CompactNodePool<Object>, detail::PointerNodePool<Object>>::type;
+	using Node = typename NodePool::Node;
+	using Link = typename NodePool::Link;
+	using Bucket = detail::ObjectBucket<Object, Node>;
+	using Cell = detail::NodeCell<Number>;
+	using SlotCell = typename std::conditional<Policy::cache_node_cells,
+		Cell, detail::NoNodeCell<Number>>::type;
+	using FatBox = detail::FatBoundingBox<Number>;
+	using SlotFatBox = typename std::conditional<Policy::fat_bounding_boxes,
+		FatBox, detail::NoFatBoundingBox<Number>>::type;
+	// an update reads the cell and the fat box along with the node of the object,
+	// no node or bucket is touched
+	struct Slot : detail::ObjectSlot<Node>, SlotCell, SlotFatBox {};
+	struct BatchEntry {
+		std::uint64_t key; ///< what the batch is sorted by
+		Object* object;
+		Slot* slot; ///< nullptr if it is not in the tree yet
+		bounding_box<Number> object_bounds;
+	};
+	// the nodes of a descent with their cells as far as it got, the next one of a batch
+	// starts at the deepest node it shares
+	struct PathStep {
+		Link node;
+		bounding_box<Number> node_bounds;
+		Cell cell;
+	};
+	using Path = std::vector<PathStep>;
+	struct MaintenanceStep {
+		Link node;
+		bounding_box<Number> node_bounds;
+		int child; ///< the one gone into, or the last one done, -1 before the first
+	};
+	struct BuildEntry {
+		Object* object;
+		bounding_box<Number> object_bounds;
+		Number center_x; ///< of the fat bounds, like the extent
+		Number center_y;
+		Number extent;
+	};
+	// what sorting the entries leaves for every node in pre-order, making the nodes walks it
+	// again while the entries lie in the same order
+	struct BuildRecord {
+		std::uint32_t staying; ///< entries the descent stops at the node with, or kSortedApart
+		std::uint32_t children; ///< a bit per non-empty child in the order of the links (the subtree if sorted apart)
+	};
+	struct BuildSubtree {
+		bounding_box<Number> node_bounds;
+		int depth;
+		BuildEntry* first;
+		BuildEntry* last;
+		std::vector<BuildRecord> records; ///< filled by a task of its own
+	};
+	using BuildTraversal = detail::ForwardTreeTraversal<Number, Object, NodePool>;
+	constexpr static int kBuildSubtreeDepth = 2; ///< where the tasks of a parallel build take over
+	constexpr static std::size_t kBuildTaskEntries = 1 << 14; ///< extracted by a task
+	constexpr static std::uint32_t kSortedApart = 0xffffffff;
+	/// buckets down to that depth get a SortedBoxIndex once they hold the largest objects
+	/// in such numbers, queries of small regions meet them all otherwise
+	/// (batches of cached bounding boxes are tested without the BoundingBoxExtractor anyway)
+	constexpr static int kOversizedIndexDepth = Policy::cache_bounding_boxes ? 0 : 2;
+	constexpr static std::uint32_t kOversizedIndexEntries = 32; ///< at least
+	constexpr static std::size_t kOversizedIndexes = 8; ///< the least recently used one goes beyond
+	struct OversizedIndex {
+		explicit OversizedIndex(memory_resource* resource) :
+			bucket(nullptr), stale(true), last_use(0), boxes(resource) {}
+
+		const Bucket* bucket; ///< where the node is, it never moves
+		bool stale; ///< the entries or their bounding boxes changed since the sorting
+		std::uint64_t last_use;
+		detail::SortedBoxIndex<Number> boxes;
+	};
+	using ObjectSlots = typename std::conditional<
+		!std::is_void<typename Policy::object_hook_extractor>::value,
+		detail::ObjectSlotHooks<Object, Slot, typename Policy::object_hook_extractor>,
+		typename std::conditional<Policy::flat_object_map,
+			detail::ObjectSlotFlatMap<Object, Slot>,
+			detail::ObjectSlotMap<Object, Slot>>::type>::type;
+	using QueryPoolContainer =
+		std::deque<typename quad_tree<Number, Object, BoundingBoxExtractor, Policy>::query::Impl>;
+
+	Node* ResolveNode(Link link) const;
+	Link NewNode();
+	void DeleteNode(Link link);
+	Slot* NewSlot();
+	void DeleteSlot(Slot* slot);
+	static std::size_t BucketEntrySize();
+	static std::size_t BucketAlignment();
+	static Number* BucketBoxes(const Bucket& bucket); ///< lefts, tops, widths, heights
+	static void SetCachedBoundingBox(const Bucket& bucket, std::uint32_t index,
+		const bounding_box<Number>& object_bounds);
+	void AddToBucket(Link link, Object* object,
+		const bounding_box<Number>& object_bounds, Slot* slot);
+	void RemoveFromBucket(Bucket& bucket, std::uint32_t index); ///< moves the last entry into its place
+	void DetachSlot(Slot* slot); ///< leaves a tombstone if queries are running
+	const detail::SortedBoxIndex<Number>& GetOversizedIndex(const Bucket& bucket); ///< sorted again if stale
+	void TouchOversizedIndex(const Bucket& bucket); ///< the entries or their bounding boxes change
+	void DropOversizedIndex(const Bucket& bucket); ///< its node goes away
+	Slot* InsertSlot(Object* object, bool* inserted); ///< or updates the object already in the tree
+	Slot* AddSlot(Object* object, const bounding_box<Number>& object_bounds, Path* path = nullptr);
+	void UpdateSlot(Slot* slot, const bounding_box<Number>& object_bounds, Path* path = nullptr);
+	void RelocateSlot(Slot* slot, const bounding_box<Number>& object_bounds,
+		Path* path = nullptr); ///< even inside the fat box
+	void RemoveSlot(Slot* slot); ///< the object pointer has to be erased separately
+	Object* GetSlotObject(const Slot* slot) const;
+	void GrowBucket(Bucket& bucket, std::uint32_t capacity); ///< even and at least the size
+	void DeleteBucket(Bucket& bucket);
+	void RecalculateMaximalDepth();
+	void ForgetObjects(); ///< the object lookup, walks the tree if the objects hold it
+	void DeleteTree();
+	bounding_box<Number> GetFatBounds(const bounding_box<Number>& object_bounds) const; ///< what places an object
+	static void GetCenterAndExtent(const bounding_box<Number>& object_bounds,
+		Number* center_x, Number* center_y, Number* extent);
+	static Number GetLooseReach(Number extent); ///< the largest object a node of that extent takes
+	std::uint64_t GetBatchKey(const bounding_box<Number>& object_bounds) const;
+	Link GetNodeFor(const bounding_box<Number>& object_bounds, Cell* cell,
+		Path* path = nullptr, Link placed_in = Link()); ///< grows the tree as needed, placed_in holds the object already
+	void SplitNode(Link link, Path* path); ///< its objects small enough for the children go down, path leads there
+	void MergeOrSplitNode(Link link); ///< takes the objects of its leaves back if they fit, else splits it
+	void GrowRoot(Number toward_x, Number toward_y); ///< doubles it, the old root becomes a child
+	void ShrinkRoot(); ///< drops roots with a single child and nothing else, no query may be running
+	void MaintainNode(Link link, int depth, Link* parent_link); ///< parent_link is nullptr for the root
+	bool IsQueryReading(const Node* node) const;
+	static bool IsLeaf(const Node* node);
+	static Link& GetChildLink(Node* node, int child); ///< children in the order of the links
+	static bounding_box<Number> GetChildBounds(const bounding_box<Number>& node_bounds, int child);
+	void ExtractBuildEntries(Object* const* objects, BuildEntry* first, BuildEntry* last) const;
+	void SortBuildEntries(const bounding_box<Number>& node_bounds, int depth,
+		BuildEntry* first, BuildEntry* last, std::vector<BuildRecord>* records,
+		std::vector<BuildSubtree>* subtrees) const; ///< subtrees below kBuildSubtreeDepth are left for tasks if given
+	const BuildRecord* BuildNode(const BuildRecord* record, const std::vector<BuildSubtree>& subtrees,
+		Link link, const bounding_box<Number>& node_bounds, int depth, const Cell& cell,
+		BuildEntry** next_entry); ///< returns the record after the subtree of the node
+	typename query::Impl* GetAvailableQueryFromPool();
+
+	std::unique_ptr<blocks_memory_resource> own_resource_; ///< only if no resource was given
+	std::unique_ptr<blocks_memory_resource> own_node_resource_; ///< nodes only, so Clear can reset it
+	memory_resource* resource_;
+	memory_resource* node_resource_; ///< nodes, their buckets and the object slots
+	NodePool nodes_;
+	Link root_;
+	bounding_box<Number> bounding_box_;
+	ObjectSlots object_slots_;
+	int number_of_objects_;
+	int maximal_depth_;
+	detail::FullTreeTraversal<Number, Object, NodePool> internal_traversal_;
+	QueryPoolContainer query_pool_;
+	int running_queries_; ///< queries which are opened and not at their end
+	std::uint32_t modifications_; ///< counts changes of the contents, queries check it for stale hit masks
+	std::uint32_t root_growths_; ///< stamps the cells, growing or shrinking the root changes the depths and sides
+	Number fat_margin_;
+	bounding_box<Number> reserved_bounds_; ///< square, width 0 if none
+	std::vector<int> maintenance_path_; ///< the child taken at every node down to where Maintain stopped
+	std::uint32_t maintenance_root_growths_; ///< of the root the path starts at
+	Link splitting_node_; ///< a full node GetNodeFor went below of, split by its caller
+	Path split_path_; ///< the descent to a split, kept for the capacity
+	std::vector<BatchEntry> batch_; ///< kept for the capacity
+	Path batch_path_;
+	std::vector<OversizedIndex> oversized_indexes_; ///< at most kOversizedIndexes
+	std::uint64_t oversized_index_uses_;
+};
+
+
+
+
+
+
+template <typename NumberT>
 bool
 	bounding_box<NumberT>::
 intersects(const bounding_box<Number>& other) const {
@@ -521,174 +1499,622 @@ contains(Number x, Number y) const {
 
 
 
-template <typename NumberT, typename ObjectT>
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
+inline memory_resource* new_delete_resource() {
+#ifdef LQT_USE_STD_PMR
+	return std::pmr::new_delete_resource();
+#else
+	static detail::NewDeleteResource resource;
+	return &resource;
+#endif
+}
+
+inline build_executor thread_build_executor(unsigned threads) {
+	return [threads](std::vector<std::function<void()>>& tasks) {
+		// the tasks are taken one by one, their sizes differ a lot
+		std::atomic<std::size_t> next_task(0);
+		auto run_tasks = [&tasks, &next_task]() {
+			for (std::size_t task = next_task++; task < tasks.size(); task = next_task++) {
+				tasks[task]();
+			}
+		};
+		std::vector<std::thread> workers;
+		for (unsigned i = 1; i < threads && i < tasks.size(); i++) {
+			workers.emplace_back(run_tasks);
+		}
+		run_tasks();
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+	};
+}
+
+
+
+inline blocks_memory_resource::blocks_memory_resource(memory_resource* upstream) :
+	upstream_(upstream), upstream_allocation_count_(0), upstream_bytes_(0) {
+	assert(upstream_ != nullptr);
+	upstream_allocations_.previous = &upstream_allocations_;
+	upstream_allocations_.next = &upstream_allocations_;
+	upstream_allocations_.bytes = 0;
+	upstream_allocations_.alignment = 0;
+}
+
+inline blocks_memory_resource::~blocks_memory_resource() {
+	ReleaseUpstreamAllocations();
+}
+
+inline memory_resource* blocks_memory_resource::upstream_resource() const {
+	return upstream_;
+}
+
+inline void blocks_memory_resource::release_free_blocks() {
+	allocator_.ReleaseFreeBlocks();
+}
+
+inline void blocks_memory_resource::reset() {
+	allocator_.Reset();
+	ReleaseUpstreamAllocations();
+}
+
+inline blocks_stats blocks_memory_resource::get_stats() const {
+	blocks_stats stats = allocator_.GetStats();
+	stats.upstream_allocations = upstream_allocation_count_;
+	stats.upstream_bytes = upstream_bytes_;
+	return stats;
+}
+
+inline void* blocks_memory_resource::do_allocate(std::size_t bytes, std::size_t alignment) {
+	if (detail::BlocksAllocator::IsPoolable(bytes, alignment)) {
+		return allocator_.Allocate(bytes);
+	}
+	std::size_t header_size = UpstreamHeaderSize(alignment);
+	char* memory = reinterpret_cast<char*>(
+		upstream_->allocate(header_size + bytes, UpstreamAlignment(alignment)));
+	UpstreamAllocation* allocation = reinterpret_cast<UpstreamAllocation*>(
+		memory + header_size - sizeof(UpstreamAllocation));
+	allocation->previous = &upstream_allocations_;
+	allocation->next = upstream_allocations_.next;
+	allocation->bytes = bytes;
+	allocation->alignment = alignment;
+	allocation->next->previous = allocation;
+	upstream_allocations_.next = allocation;
+	upstream_allocation_count_++;
+	upstream_bytes_ += bytes;
+	return memory + header_size;
+}
+
+inline void blocks_memory_resource::do_deallocate(void* p, std::size_t bytes, std::size_t alignment) {
+	if (detail::BlocksAllocator::IsPoolable(bytes, alignment)) {
+		allocator_.Deallocate(p, bytes);
+	}
+	else {
+		UpstreamAllocation* allocation = reinterpret_cast<UpstreamAllocation*>(p) - 1;
+		assert(allocation->bytes == bytes && allocation->alignment == alignment);
+		(void)bytes;
+		(void)alignment;
+		allocation->previous->next = allocation->next;
+		allocation->next->previous = allocation->previous;
+		DeallocateUpstream(allocation);
+	}
+}
+
+inline bool blocks_memory_resource::do_is_equal(const memory_resource& other) const noexcept {
+	return this == &other;
+}
+
+inline std::size_t blocks_memory_resource::UpstreamHeaderSize(std::size_t alignment) {
+	// the header sits right before the returned memory which has to stay aligned
+	return (sizeof(UpstreamAllocation) + alignment - 1) / alignment * alignment;
+}
+
+inline std::size_t blocks_memory_resource::UpstreamAlignment(std::size_t alignment) {
+	return alignment > alignof(UpstreamAllocation) ? alignment : alignof(UpstreamAllocation);
+}
+
+inline void blocks_memory_resource::DeallocateUpstream(UpstreamAllocation* allocation) {
+	std::size_t header_size = UpstreamHeaderSize(allocation->alignment);
+	std::size_t bytes = allocation->bytes;
+	std::size_t alignment = allocation->alignment;
+	upstream_allocation_count_--;
+	upstream_bytes_ -= bytes;
+	upstream_->deallocate(reinterpret_cast<char*>(allocation + 1) - header_size,
+		header_size + bytes, UpstreamAlignment(alignment));
+}
+
+inline void blocks_memory_resource::ReleaseUpstreamAllocations() {
+	UpstreamAllocation* allocation = upstream_allocations_.next;
+	while (allocation != &upstream_allocations_) {
+		UpstreamAllocation* next = allocation->next;
+		DeallocateUpstream(allocation);
+		allocation = next;
+	}
+	upstream_allocations_.previous = &upstream_allocations_;
+	upstream_allocations_.next = &upstream_allocations_;
+}
+
+
+
+template <typename ObjectT>
+	detail::PointerNodePool<ObjectT>::
+PointerNodePool(memory_resource* resource) : resource_(resource) {
+}
+
+template <typename ObjectT>
+auto
+	detail::PointerNodePool<ObjectT>::
+Resolve(const PointerNodePool<ObjectT>*, Link link) -> Node* {
+	return link;
+}
+
+template <typename ObjectT>
+auto
+	detail::PointerNodePool<ObjectT>::
+New() -> Link {
+	void* memory = resource_->allocate(sizeof(Node), alignof(Node));
+	return new(memory) Node();
+}
+
+template <typename ObjectT>
+void
+	detail::PointerNodePool<ObjectT>::
+Delete(Link link) {
+	link->~Node();
+	resource_->deallocate(link, sizeof(Node), alignof(Node));
+}
+
+template <typename ObjectT>
+void
+	detail::PointerNodePool<ObjectT>::
+Reset() {
+}
+
+
+
+template <typename ObjectT>
+	detail::CompactNodePool<ObjectT>::
+CompactNodePool(memory_resource* resource) :
+	chunks_(MemoryResourceAdaptor<Node*>(resource)), resource_(resource),
+	first_free_(0), first_unused_(1) {
+}
+
+template <typename ObjectT>
+	detail::CompactNodePool<ObjectT>::
+~CompactNodePool() {
+	for (Node* chunk : chunks_) {
+		resource_->deallocate(chunk, kChunkNodes * sizeof(Node), alignof(Node));
+	}
+}
+
+template <typename ObjectT>
+auto
+	detail::CompactNodePool<ObjectT>::
+Resolve(const CompactNodePool<ObjectT>* pool, Link link) -> Node* {
+	if (link == 0) {
+		return nullptr;
+	}
+	assert(pool != nullptr && link < pool->first_unused_);
+	return pool->chunks_[link >> kChunkShift] + (link & (kChunkNodes - 1));
+}
+
+template <typename ObjectT>
+auto
+	detail::CompactNodePool<ObjectT>::
+New() -> Link {
+	Link link = first_free_;
+	if (link != 0) {
+		first_free_ = Resolve(this, link)->top_left;
+	}
+	else {
+		if ((first_unused_ >> kChunkShift) == chunks_.size()) {
+			void* memory = resource_->allocate(kChunkNodes * sizeof(Node), alignof(Node));
+			chunks_.push_back(static_cast<Node*>(memory));
+		}
+		assert(first_unused_ < std::numeric_limits<Link>::max());
+		link = first_unused_++;
+	}
+	new(Resolve(this, link)) Node();
+	return link;
+}
+
+template <typename ObjectT>
+void
+	detail::CompactNodePool<ObjectT>::
+Delete(Link link) {
+	Node* node = Resolve(this, link);
+	node->top_left = first_free_;
+	first_free_ = link;
+}
+
+template <typename ObjectT>
+void
+	detail::CompactNodePool<ObjectT>::
+Reset() {
+	first_free_ = 0;
+	first_unused_ = 1;
+}
+
+
+
+template <typename ObjectT, typename SlotT>
+	detail::ObjectSlotFlatMap<ObjectT, SlotT>::
+ObjectSlotFlatMap(memory_resource* resource) :
+	resource_(resource), entries_(nullptr), capacity_(0), size_(0), shift_(64) {
+}
+
+template <typename ObjectT, typename SlotT>
+	detail::ObjectSlotFlatMap<ObjectT, SlotT>::
+~ObjectSlotFlatMap() {
+	if (entries_ != nullptr) {
+		resource_->deallocate(entries_, capacity_ * sizeof(Entry), alignof(Entry));
+	}
+}
+
+template <typename ObjectT, typename SlotT>
+auto
+	detail::ObjectSlotFlatMap<ObjectT, SlotT>::
+Find(Object* object) const -> Slot* {
+	if (size_ == 0) {
+		return nullptr;
+	}
+	std::size_t mask = capacity_ - 1;
+	for (std::size_t i = GetHome(object); entries_[i].object != nullptr; i = (i + 1) & mask) {
+		if (entries_[i].object == object) {
+			return entries_[i].slot;
+		}
+	}
+	return nullptr;
+}
+
+template <typename ObjectT, typename SlotT>
+void
+	detail::ObjectSlotFlatMap<ObjectT, SlotT>::
+Insert(Object* object, Slot* slot) {
+	assert(object != nullptr);
+	assert(Find(object) == nullptr);
+	Reserve(size_ + 1);
+	std::size_t mask = capacity_ - 1;
+	std::size_t i = GetHome(object);
+	while (entries_[i].object != nullptr) {
+		i = (i + 1) & mask;
+	}
+	entries_[i].object = object;
+	entries_[i].slot = slot;
+	size_++;
+}
+
+template <typename ObjectT, typename SlotT>
+void
+	detail::ObjectSlotFlatMap<ObjectT, SlotT>::
+Erase(Object* object) {
+	assert(Find(object) != nullptr);
+	std::size_t mask = capacity_ - 1;
+	std::size_t hole = GetHome(object);
+	while (entries_[hole].object != object) {
+		hole = (hole + 1) & mask;
+	}
+	// an entry after the hole moves into it unless its home lies after the hole
+	for (std::size_t i = (hole + 1) & mask; entries_[i].object != nullptr; i = (i + 1) & mask) {
+		std::size_t home = GetHome(entries_[i].object);
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			entries_[hole] = entries_[i];
+			hole = i;
+		}
+	}
+	entries_[hole].object = nullptr;
+	size_--;
+}
+
+template <typename ObjectT, typename SlotT>
+void
+	detail::ObjectSlotFlatMap<ObjectT, SlotT>::
+Clear() {
+	for (std::size_t i = 0; i < capacity_; i++) {
+		entries_[i].object = nullptr;
+	}
+	size_ = 0;
+}
+
+template <typename ObjectT, typename SlotT>
+void
+	detail::ObjectSlotFlatMap<ObjectT, SlotT>::
+Reserve(std::size_t size) {
+	// at most 3/4 full, probe sequences get long beyond
+	if (size * 4 > capacity_ * 3) {
+		std::size_t capacity = capacity_ == 0 ? 16 : capacity_;
+		while (size * 4 > capacity * 3) {
+			capacity *= 2;
+		}
+		Rehash(capacity);
+	}
+}
+
+template <typename ObjectT, typename SlotT>
+std::size_t
+	detail::ObjectSlotFlatMap<ObjectT, SlotT>::
+GetBucketCount() const {
+	return capacity_;
+}
+
+template <typename ObjectT, typename SlotT>
+std::size_t
+	detail::ObjectSlotFlatMap<ObjectT, SlotT>::
+GetBytes() const {
+	return capacity_ * sizeof(Entry);
+}
+
+template <typename ObjectT, typename SlotT>
+std::size_t
+	detail::ObjectSlotFlatMap<ObjectT, SlotT>::
+GetHome(Object* object) const {
+	// Fibonacci hashing, the top bits of the product mix all bits of the pointer
+	std::uint64_t hash = (std::uint64_t)(std::uintptr_t)object * 0x9E3779B97F4A7C15ull;
+	return (std::size_t)(hash >> shift_);
+}
+
+template <typename ObjectT, typename SlotT>
+void
+	detail::ObjectSlotFlatMap<ObjectT, SlotT>::
+Rehash(std::size_t capacity) {
+	Entry* old_entries = entries_;
+	std::size_t old_capacity = capacity_;
+	entries_ = static_cast<Entry*>(resource_->allocate(capacity * sizeof(Entry), alignof(Entry)));
+	capacity_ = capacity;
+	shift_ = 64;
+	for (std::size_t bits = capacity; bits > 1; bits >>= 1) {
+		shift_--;
+	}
+	for (std::size_t i = 0; i < capacity_; i++) {
+		entries_[i].object = nullptr;
+	}
+	std::size_t mask = capacity_ - 1;
+	for (std::size_t i = 0; i < old_capacity; i++) {
+		if (old_entries[i].object != nullptr) {
+			std::size_t j = GetHome(old_entries[i].object);
+			while (entries_[j].object != nullptr) {
+				j = (j + 1) & mask;
+			}
+			entries_[j] = old_entries[i];
+		}
+	}
+	if (old_entries != nullptr) {
+		resource_->deallocate(old_entries, old_capacity * sizeof(Entry), alignof(Entry));
+	}
+}
+
+
+
+template <typename NumberT>
+	detail::SortedBoxIndex<NumberT>::
+SortedBoxIndex(memory_resource* resource) :
+	entries_(MemoryResourceAdaptor<Entry>(resource)), widest_(0) {
+}
+
+template <typename NumberT>
+void
+	detail::SortedBoxIndex<NumberT>::
+Clear() {
+	entries_.clear();
+	widest_ = 0;
+}
+
+template <typename NumberT>
+void
+	detail::SortedBoxIndex<NumberT>::
+Add(const bounding_box<Number>& bounds, std::uint32_t index) {
+	entries_.push_back({bounds.left, bounds.top, bounds.width, bounds.height, index});
+	if (bounds.width > widest_) {
+		widest_ = bounds.width;
+	}
+}
+
+template <typename NumberT>
+void
+	detail::SortedBoxIndex<NumberT>::
+Sort() {
+	std::sort(entries_.begin(), entries_.end(), [](const Entry& entry1, const Entry& entry2) {
+		return entry1.left < entry2.left;
+	});
+}
+
+template <typename NumberT>
+void
+	detail::SortedBoxIndex<NumberT>::
+MarkTouching(const bounding_box<Number>& region, std::uint32_t* bits) const {
+	const Number region_right = (Number)(region.left + region.width);
+	const Number region_bottom = (Number)(region.top + region.height);
+	// differences only, unsigned numbers must not wrap around
+	auto first = std::partition_point(entries_.begin(), entries_.end(), [&](const Entry& entry) {
+		return entry.left < region.left && region.left - entry.left > widest_;
+	});
+	auto last = std::partition_point(first, entries_.end(), [&](const Entry& entry) {
+		return entry.left <= region_right;
+	});
+	for (auto it = first; it != last; ++it) {
+		if (it->left + it->width >= region.left &&
+				it->top <= region_bottom && it->top + it->height >= region.top) {
+			bits[it->index / 32] |= 1u << (it->index % 32);
+		}
+	}
+}
+
+
+
+template <typename NumberT, typename ObjectT, typename NodePoolT>
+	detail::ForwardTreeTraversal<NumberT, ObjectT, NodePoolT>::
 ForwardTreeTraversal() :
-	position_(bounding_box<Number>(0, 0, 0, 0), nullptr), depth_(0) {
+	position_(bounding_box<Number>(0, 0, 0, 0), nullptr), depth_(0), pool_(nullptr) {
 }
 
-template <typename NumberT, typename ObjectT>
+template <typename NumberT, typename ObjectT, typename NodePoolT>
 void
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
-StartAt(TreeNode<Object>* root, const bounding_box<Number>& root_bounds) {
+	detail::ForwardTreeTraversal<NumberT, ObjectT, NodePoolT>::
+StartAt(Node* root, const bounding_box<Number>& root_bounds, const NodePool* pool) {
 	position_.bbox = root_bounds;
 	position_.node = root;
+	pool_ = pool;
 	depth_ = 0;
 }
 
-template <typename NumberT, typename ObjectT>
+template <typename NumberT, typename ObjectT, typename NodePoolT>
 int
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
+	detail::ForwardTreeTraversal<NumberT, ObjectT, NodePoolT>::
 GetDepth() const {
 	return depth_;
 }
 
-template <typename NumberT, typename ObjectT>
-detail::TreeNode<ObjectT>*
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
+template <typename NumberT, typename ObjectT, typename NodePoolT>
+typename NodePoolT::Node*
+	detail::ForwardTreeTraversal<NumberT, ObjectT, NodePoolT>::
 GetNode() const {
 	return position_.node;
 }
 
-template <typename NumberT, typename ObjectT>
+template <typename NumberT, typename ObjectT, typename NodePoolT>
 const bounding_box<NumberT>&
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
+	detail::ForwardTreeTraversal<NumberT, ObjectT, NodePoolT>::
 GetNodeBoundingBox() const {
 	return position_.bbox;
 }
 
-template <typename NumberT, typename ObjectT>
+template <typename NumberT, typename ObjectT, typename NodePoolT>
+bounding_box<NumberT>
+	detail::ForwardTreeTraversal<NumberT, ObjectT, NodePoolT>::
+GetChildBoundingBox(const bounding_box<Number>& bbox, ChildPosition child_position) {
+	assert(child_position != ChildPosition::kNone);
+	bounding_box<Number> child_bbox = bbox;
+	if (child_position == ChildPosition::kTopLeft || child_position == ChildPosition::kBottomLeft) {
+		child_bbox.width = (Number)((typename MakeDistance<Number>::Type)bbox.width / 2);
+	}
+	else {
+		Number right = (Number)(bbox.left + bbox.width);
+		child_bbox.left = (Number)(bbox.left +
+				(Number)((typename MakeDistance<Number>::Type)bbox.width / 2));
+		child_bbox.width = (Number)(right - child_bbox.left);
+	}
+	if (child_position == ChildPosition::kTopLeft || child_position == ChildPosition::kTopRight) {
+		child_bbox.height = (Number)((typename MakeDistance<Number>::Type)bbox.height / 2);
+	}
+	else {
+		Number bottom = (Number)(bbox.top + bbox.height);
+		child_bbox.top = (Number)(bbox.top +
+				(Number)((typename MakeDistance<Number>::Type)bbox.height / 2));
+		child_bbox.height = (Number)(bottom - child_bbox.top);
+	}
+	return child_bbox;
+}
+
+template <typename NumberT, typename ObjectT, typename NodePoolT>
 void
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
+	detail::ForwardTreeTraversal<NumberT, ObjectT, NodePoolT>::
 GoTopLeft() {
-	bounding_box<Number>& bbox = position_.bbox;
-	bbox.width = (Number)((typename MakeDistance<Number>::Type)bbox.width / 2);
-	bbox.height = (Number)((typename MakeDistance<Number>::Type)bbox.height / 2);
-	position_.node = position_.node->top_left;
+	position_.bbox = GetChildBoundingBox(position_.bbox, ChildPosition::kTopLeft);
+	position_.node = NodePool::Resolve(pool_, position_.node->top_left);
 	assert(position_.node != nullptr);
 	depth_++;
 }
 
-template <typename NumberT, typename ObjectT>
+template <typename NumberT, typename ObjectT, typename NodePoolT>
 void
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
+	detail::ForwardTreeTraversal<NumberT, ObjectT, NodePoolT>::
 GoTopRight() {
-	bounding_box<Number>& bbox = position_.bbox;
-	Number right = (Number)(bbox.left + bbox.width);
-	bbox.left = (Number)(bbox.left +
-			(Number)((typename MakeDistance<Number>::Type)bbox.width / 2));
-	bbox.width = (Number)(right - bbox.left);
-	bbox.height = (Number)((typename MakeDistance<Number>::Type)bbox.height / 2);
-	position_.node = position_.node->top_right;
+	position_.bbox = GetChildBoundingBox(position_.bbox, ChildPosition::kTopRight);
+	position_.node = NodePool::Resolve(pool_, position_.node->top_right);
 	assert(position_.node != nullptr);
 	depth_++;
 }
 
-template <typename NumberT, typename ObjectT>
+template <typename NumberT, typename ObjectT, typename NodePoolT>
 void
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
+	detail::ForwardTreeTraversal<NumberT, ObjectT, NodePoolT>::
 GoBottomRight() {
-	bounding_box<Number>& bbox = position_.bbox;
-	Number right = (Number)(bbox.left + bbox.width);
-	bbox.left = (Number)(bbox.left +
-			(Number)((typename MakeDistance<Number>::Type)bbox.width / 2));
-	bbox.width = (Number)(right - bbox.left);
-	Number bottom = (Number)(bbox.top + bbox.height);
-	bbox.top = (Number)(bbox.top +
-			(Number)((typename MakeDistance<Number>::Type)bbox.height / 2));
-	bbox.height = (Number)(bottom - bbox.top);
-	position_.node = position_.node->bottom_right;
+	position_.bbox = GetChildBoundingBox(position_.bbox, ChildPosition::kBottomRight);
+	position_.node = NodePool::Resolve(pool_, position_.node->bottom_right);
 	assert(position_.node != nullptr);
 	depth_++;
 }
 
-template <typename NumberT, typename ObjectT>
+template <typename NumberT, typename ObjectT, typename NodePoolT>
 void
-	detail::ForwardTreeTraversal<NumberT, ObjectT>::
+	detail::ForwardTreeTraversal<NumberT, ObjectT, NodePoolT>::
 GoBottomLeft() {
-	bounding_box<Number>& bbox = position_.bbox;
-	bbox.width = (Number)((typename MakeDistance<Number>::Type)bbox.width / 2);
-	Number bottom = (Number)(bbox.top + bbox.height);
-	bbox.top = (Number)(bbox.top +
-			(Number)((typename MakeDistance<Number>::Type)bbox.height / 2));
-	bbox.height = (Number)(bottom - bbox.top);
-	position_.node = position_.node->bottom_left;
+	position_.bbox = GetChildBoundingBox(position_.bbox, ChildPosition::kBottomLeft);
+	position_.node = NodePool::Resolve(pool_, position_.node->bottom_left);
 	assert(position_.node != nullptr);
 	depth_++;
 }
 
 
 
-template <typename NumberT, typename ObjectT>
+template <typename NumberT, typename ObjectT, typename NodePoolT>
 void
-	detail::FullTreeTraversal<NumberT, ObjectT>::
-StartAt(TreeNode<Object>* root, const bounding_box<Number>& root_bounds) {
-	ForwardTreeTraversal<Number, Object>::StartAt(root, root_bounds);
+	detail::FullTreeTraversal<NumberT, ObjectT, NodePoolT>::
+StartAt(Node* root, const bounding_box<Number>& root_bounds, const NodePool* pool) {
+	ForwardTreeTraversal<Number, Object, NodePool>::StartAt(root, root_bounds, pool);
 	position_.current_child = ChildPosition::kNone;
 	position_stack_.clear();
 }
 
-template <typename NumberT, typename ObjectT>
+template <typename NumberT, typename ObjectT, typename NodePoolT>
 detail::ChildPosition
-	detail::FullTreeTraversal<NumberT, ObjectT>::
+	detail::FullTreeTraversal<NumberT, ObjectT, NodePoolT>::
 GetNodeCurrentChild() const {
 	return position_.current_child;
 }
 
-template <typename NumberT, typename ObjectT>
+template <typename NumberT, typename ObjectT, typename NodePoolT>
 void
-	detail::FullTreeTraversal<NumberT, ObjectT>::
+	detail::FullTreeTraversal<NumberT, ObjectT, NodePoolT>::
 SetNodeCurrentChild(ChildPosition child_position) {
 	position_.current_child = child_position;
 }
 
-template <typename NumberT, typename ObjectT>
+template <typename NumberT, typename ObjectT, typename NodePoolT>
 void
-	detail::FullTreeTraversal<NumberT, ObjectT>::
+	detail::FullTreeTraversal<NumberT, ObjectT, NodePoolT>::
 GoTopLeft() {
 	assert((size_t)depth_ == position_stack_.size());
 	position_.current_child = ChildPosition::kTopLeft;
 	position_stack_.emplace_back(position_);
-	ForwardTreeTraversal<Number, Object>::GoTopLeft();
+	ForwardTreeTraversal<Number, Object, NodePool>::GoTopLeft();
 	position_.current_child = ChildPosition::kNone;
 }
 
-template <typename NumberT, typename ObjectT>
+template <typename NumberT, typename ObjectT, typename NodePoolT>
 void
-	detail::FullTreeTraversal<NumberT, ObjectT>::
+	detail::FullTreeTraversal<NumberT, ObjectT, NodePoolT>::
 GoTopRight() {
 	assert((size_t)depth_ == position_stack_.size());
 	position_.current_child = ChildPosition::kTopRight;
 	position_stack_.emplace_back(position_);
-	ForwardTreeTraversal<Number, Object>::GoTopRight();
+	ForwardTreeTraversal<Number, Object, NodePool>::GoTopRight();
 	position_.current_child = ChildPosition::kNone;
 }
 
-template <typename NumberT, typename ObjectT>
+template <typename NumberT, typename ObjectT, typename NodePoolT>
 void
-	detail::FullTreeTraversal<NumberT, ObjectT>::
+	detail::FullTreeTraversal<NumberT, ObjectT, NodePoolT>::
 GoBottomRight() {
 	assert((size_t)depth_ == position_stack_.size());
 	position_.current_child = ChildPosition::kBottomRight;
 	position_stack_.emplace_back(position_);
-	ForwardTreeTraversal<Number, Object>::GoBottomRight();
+	ForwardTreeTraversal<Number, Object, NodePool>::GoBottomRight();
 	position_.current_child = ChildPosition::kNone;
 }
 
-template <typename NumberT, typename ObjectT>
+template <typename NumberT, typename ObjectT, typename NodePoolT>
 void
-	detail::FullTreeTraversal<NumberT, ObjectT>::
+	detail::FullTreeTraversal<NumberT, ObjectT, NodePoolT>::
 GoBottomLeft() {
 	assert((size_t)depth_ == position_stack_.size());
 	position_.current_child = ChildPosition::kBottomLeft;
 	position_stack_.emplace_back(position_);
-	ForwardTreeTraversal<Number, Object>::GoBottomLeft();
+	ForwardTreeTraversal<Number, Object, NodePool>::GoBottomLeft();
 	position_.current_child = ChildPosition::kNone;
 }
 
-template <typename NumberT, typename ObjectT>
+template <typename NumberT, typename ObjectT, typename NodePoolT>
 void
-	detail::FullTreeTraversal<NumberT, ObjectT>::
+	detail::FullTreeTraversal<NumberT, ObjectT, NodePoolT>::
 GoUp() {
 	assert((size_t)depth_ == position_stack_.size() && depth_ > 0);
 	position_ = position_stack_.back();
@@ -698,17 +2124,18 @@ GoUp() {
 
 
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::Impl::
-Impl() : quadtree_(nullptr), query_region_(0,0,0,0),
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::Impl::
+Impl() : quadtree_(nullptr), object_index_(0), hit_mask_(0), hit_mask_begin_(0),
+	hit_mask_end_(0), hit_mask_modifications_(0), indexed_hits_modifications_(0), query_region_(0,0,0,0),
 	query_type_(QueryType::kEndOfQuery),
-	free_ride_from_level_(quad_tree<Number, Object, BoundingBoxExtractor>::impl::kInternalMaxDepth) {
+	free_ride_from_level_(quad_tree<Number, Object, BoundingBoxExtractor, Policy>::impl::kInternalMaxDepth + 1) {
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 void
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::Impl::
-Acquire(typename quad_tree<Number, Object, BoundingBoxExtractor>::impl* quadtree,
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::Impl::
+Acquire(typename quad_tree<Number, Object, BoundingBoxExtractor, Policy>::impl* quadtree,
         const bounding_box<Number>* query_region, QueryType query_type) {
 	assert(IsAvailable());
 	assert(query_type != QueryType::kEndOfQuery);
@@ -716,71 +2143,92 @@ Acquire(typename quad_tree<Number, Object, BoundingBoxExtractor>::impl* quadtree
 	query_region_ = *query_region;
 	query_type_ = query_type;
 	free_ride_from_level_ =
-		quad_tree<Number, Object, BoundingBoxExtractor>::impl::kInternalMaxDepth;
-	if (quadtree->root_ == nullptr) {
+		quad_tree<Number, Object, BoundingBoxExtractor, Policy>::impl::kInternalMaxDepth + 1;
+	if (quadtree->root_ == Link()) {
 		query_type_ = QueryType::kEndOfQuery;
 	}
 	else {
 		quadtree_->running_queries_++;
-		traversal_.StartAt(quadtree->root_, quadtree->bounding_box_);
-		object_iterator_ = traversal_.GetNode()->objects.before_begin();
-		Next();
+		traversal_.StartAt(quadtree->ResolveNode(quadtree->root_), quadtree->bounding_box_,
+			&quadtree->nodes_);
+		object_index_ = 0;
+		hit_mask_end_ = 0;
+		MarkIndexedHits();
+		SeekFittingObject();
 	}
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 void
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::Impl::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::Impl::
 Release() {
 	assert(!IsAvailable());
+	if (query_type_ != QueryType::kEndOfQuery) {
+		// released before its end
+		quadtree_->running_queries_--;
+	}
   // state reset
   this->quadtree_ = nullptr;
   this->traversal_ = {};
-  this->object_iterator_ = {};
-  this->object_iterator_before_ = {};
+  this->object_index_ = {};
+  this->indexed_hits_.clear();
   this->query_type_ = {};
   this->free_ride_from_level_ = {};
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 bool
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::Impl::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::Impl::
 IsAvailable() const {
 	return quadtree_ == nullptr;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 bool
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::Impl::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::Impl::
 end_of_query() const {
 	assert(!IsAvailable());
 	return query_type_ == QueryType::kEndOfQuery;
 }
 
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 ObjectT*
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::Impl::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::Impl::
 GetCurrent() const {
 	assert(!IsAvailable());
 	assert(!end_of_query());
-	return *object_iterator_;
+	return traversal_.GetNode()->objects.Objects()[object_index_];
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 void
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::Impl::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::Impl::
 Next() {
 	assert(!IsAvailable());
 	assert(!end_of_query());
+	object_index_++;
+	SeekFittingObject();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+bool
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::Impl::
+IsReading(const Node* node) const {
+	return !IsAvailable() && !end_of_query() && traversal_.GetNode() == node;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::Impl::
+SeekFittingObject() {
 	do {
-		object_iterator_before_ = object_iterator_;
-		object_iterator_++;
-		if (object_iterator_ == traversal_.GetNode()->objects.end()) {
+		Bucket& objects = traversal_.GetNode()->objects;
+		if (object_index_ >= objects.size) {
 			do {
 				switch (traversal_.GetNodeCurrentChild()) {
 				case detail::ChildPosition::kNone:
-					if (traversal_.GetNode()->top_left == nullptr) {
+					if (traversal_.GetNode()->top_left == Link()) {
 						traversal_.SetNodeCurrentChild(detail::ChildPosition::kTopLeft);
 						continue;
 					}
@@ -789,7 +2237,7 @@ Next() {
 					}
 					break;
 				case detail::ChildPosition::kTopLeft:
-					if (traversal_.GetNode()->top_right == nullptr) {
+					if (traversal_.GetNode()->top_right == Link()) {
 						traversal_.SetNodeCurrentChild(detail::ChildPosition::kTopRight);
 						continue;
 					}
@@ -798,7 +2246,7 @@ Next() {
 					}
 					break;
 				case detail::ChildPosition::kTopRight:
-					if (traversal_.GetNode()->bottom_right == nullptr) {
+					if (traversal_.GetNode()->bottom_right == Link()) {
 						traversal_.SetNodeCurrentChild(detail::ChildPosition::kBottomRight);
 						continue;
 					}
@@ -807,7 +2255,7 @@ Next() {
 					}
 					break;
 				case detail::ChildPosition::kBottomRight:
-					if (traversal_.GetNode()->bottom_left == nullptr) {
+					if (traversal_.GetNode()->bottom_left == Link()) {
 						traversal_.SetNodeCurrentChild(detail::ChildPosition::kBottomLeft);
 						continue;
 					}
@@ -828,72 +2276,81 @@ Next() {
 					//only run this if no parallel queries are running
 					if (traversal_.GetDepth() > quadtree_->maximal_depth_ &&
 							quadtree_->running_queries_ == 1) {
-						typename detail::TreeNode<Object>::ObjectContainer& objects =
-								traversal_.GetNode()->objects;
-						auto iterator = objects.begin();
-						while (iterator != objects.end()) {
-							if (*iterator != nullptr) {
-								quadtree_->Update(*iterator);
-								assert(*iterator == nullptr);
+						// the objects go to shallower nodes and leave tombstones here
+						using Slot = typename quad_tree<Number, Object, BoundingBoxExtractor, Policy>::impl::Slot;
+						Bucket& node_objects = traversal_.GetNode()->objects;
+						for (std::uint32_t i = 0; i < node_objects.size; i++) {
+							Object* object = node_objects.Objects()[i];
+							if (object != nullptr) {
+								bounding_box<Number> object_bounds(0, 0, 0, 0);
+								BoundingBoxExtractor::ExtractBoundingBox(object, &object_bounds);
+								quadtree_->RelocateSlot(static_cast<Slot*>(node_objects.Slots()[i]), object_bounds);
+								assert(node_objects.Objects()[i] == nullptr);
 							}
-							iterator++;
 						}
-						objects.clear();
+						node_objects.size = 0;
+						quadtree_->TouchOversizedIndex(node_objects);
 					}
 
 					if (traversal_.GetDepth() > 0) {
-						bool remove_node = (traversal_.GetNode()->objects.empty() &&
-								traversal_.GetNode()->top_left == nullptr &&
-								traversal_.GetNode()->top_right == nullptr &&
-								traversal_.GetNode()->bottom_right == nullptr &&
-								traversal_.GetNode()->bottom_left == nullptr);
-						detail::TreeNode<Object>* node = traversal_.GetNode();
+						bool remove_node = (traversal_.GetNode()->objects.Empty() &&
+								traversal_.GetNode()->top_left == Link() &&
+								traversal_.GetNode()->top_right == Link() &&
+								traversal_.GetNode()->bottom_right == Link() &&
+								traversal_.GetNode()->bottom_left == Link());
+						Node* node = traversal_.GetNode();
 						traversal_.GoUp();
 
 						// if the node is empty no other queries can be invalidated by deleting
 						if (remove_node) {
+							Link* link = &traversal_.GetNode()->top_left;
 							switch (traversal_.GetNodeCurrentChild()) {
 							case detail::ChildPosition::kTopLeft:
-								traversal_.GetNode()->top_left = nullptr;
 								break;
 							case detail::ChildPosition::kTopRight:
-								traversal_.GetNode()->top_right = nullptr;
+								link = &traversal_.GetNode()->top_right;
 								break;
 							case detail::ChildPosition::kBottomRight:
-								traversal_.GetNode()->bottom_right = nullptr;
+								link = &traversal_.GetNode()->bottom_right;
 								break;
 							case detail::ChildPosition::kBottomLeft:
-								traversal_.GetNode()->bottom_left = nullptr;
+								link = &traversal_.GetNode()->bottom_left;
 								break;
 							case detail::ChildPosition::kNone:
 								assert(false);
 							}
-							quadtree_->allocator_.Delete(node);
+							assert(quadtree_->ResolveNode(*link) == node);
+							(void)node;
+							quadtree_->DeleteNode(*link);
+							*link = Link();
 						}
 
 						if (free_ride_from_level_ == traversal_.GetDepth() + 1) {
 							free_ride_from_level_ =
 								quad_tree<Number, Object,
-									BoundingBoxExtractor>::impl::kInternalMaxDepth;
+									BoundingBoxExtractor, Policy>::impl::kInternalMaxDepth + 1;
 						}
 						continue;
 					}
 					else {
 						// if the root is empty no other queries can be invalidated by deleting
-						if (traversal_.GetNode()->objects.empty() &&
-								traversal_.GetNode()->top_left == nullptr &&
-								traversal_.GetNode()->top_right == nullptr &&
-								traversal_.GetNode()->bottom_right == nullptr &&
-								traversal_.GetNode()->bottom_left == nullptr) {
-							assert(traversal_.GetNode() == quadtree_->root_);
+						if (traversal_.GetNode()->objects.Empty() &&
+								traversal_.GetNode()->top_left == Link() &&
+								traversal_.GetNode()->top_right == Link() &&
+								traversal_.GetNode()->bottom_right == Link() &&
+								traversal_.GetNode()->bottom_left == Link()) {
+							assert(traversal_.GetNode() == quadtree_->ResolveNode(quadtree_->root_));
 							assert(quadtree_->GetSize() == 0);
-							assert(quadtree_->object_pointers_.size() == 0);
-							quadtree_->allocator_.Delete(quadtree_->root_);
-							quadtree_->root_ = nullptr;
+							quadtree_->DeleteNode(quadtree_->root_);
+							quadtree_->root_ = Link();
 							quadtree_->bounding_box_ = bounding_box<Number>(0, 0, 0, 0);
 						}
 
 						quadtree_->running_queries_--;
+						// the nodes emptied on the way may have left the root above the contents
+						if (quadtree_->running_queries_ == 0) {
+							quadtree_->ShrinkRoot();
+						}
 						query_type_ = QueryType::kEndOfQuery;
 						return;
 					}
@@ -913,28 +2370,53 @@ Next() {
 						continue;
 					}
 				}
-				object_iterator_ = traversal_.GetNode()->objects.before_begin();
+				object_index_ = 0;
+				hit_mask_end_ = 0;
+				MarkIndexedHits();
 				break;
 			} while (true);
 		}
-		else if (*object_iterator_ == nullptr) {
-			// other queries also cannot stop on an empty object,
-			// so we are not invalidating any iterators/queries with this
-			traversal_.GetNode()->objects.erase_after(object_iterator_before_);
-			object_iterator_ = object_iterator_before_;
+		else if (objects.Objects()[object_index_] == nullptr) {
+			// other running queries keep positions in the buckets,
+			// so only the single running one can move entries around
+			if (quadtree_->running_queries_ == 1) {
+				quadtree_->RemoveFromBucket(objects, object_index_);
+				hit_mask_end_ = 0;
+				MoveIndexedHit(objects.size, object_index_);
+			}
+			else {
+				object_index_++;
+			}
+		}
+		else if (traversal_.GetDepth() >= free_ride_from_level_) {
+			break;
+		}
+		else if (Policy::cache_bounding_boxes) {
+			std::uint32_t hit_index = NextCachedHit();
+			if (hit_index == object_index_) {
+				break;
+			}
+			object_index_ = hit_index;
 		}
 		else {
-			if (traversal_.GetDepth() >= free_ride_from_level_ ||
-					CurrentObjectFits()) {
+			if (!indexed_hits_.empty()) {
+				std::uint32_t hit_index = NextIndexedHit();
+				if (hit_index != object_index_) {
+					object_index_ = hit_index;
+					continue;
+				}
+			}
+			if (CurrentObjectFits()) {
 				break;
 			}
+			object_index_++;
 		}
 	} while (true);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 bool
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::Impl::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::Impl::
 CurrentObjectFits() const {
 	bounding_box<Number> object_bounds(0, 0, 0, 0);
 	BoundingBoxExtractor::ExtractBoundingBox(GetCurrent(), &object_bounds);
@@ -951,20 +2433,123 @@ CurrentObjectFits() const {
 	return false;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+std::uint32_t
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::Impl::
+NextCachedHit() {
+	const Bucket& objects = traversal_.GetNode()->objects;
+	assert(object_index_ < objects.size);
+	if (object_index_ < hit_mask_begin_ || object_index_ >= hit_mask_end_ ||
+			hit_mask_modifications_ != quadtree_->modifications_) {
+		detail::BoxTest test = detail::BoxTest::kIntersects;
+		switch (query_type_) {
+		case QueryType::kIntersects:
+			test = detail::BoxTest::kIntersects;
+			break;
+		case QueryType::kInside:
+			test = detail::BoxTest::kInside;
+			break;
+		case QueryType::kContains:
+			test = detail::BoxTest::kContains;
+			break;
+		case QueryType::kEndOfQuery:
+			assert(false);
+		}
+		std::uint32_t count = objects.size - object_index_;
+		if (count > detail::kBoxTestBatch) {
+			count = detail::kBoxTestBatch;
+		}
+		const Number* boxes =
+			quad_tree<Number, Object, BoundingBoxExtractor, Policy>::impl::BucketBoxes(objects) + object_index_;
+		hit_mask_ = detail::BoxKernel<Number>::Type::Test(test, boxes, boxes + objects.capacity,
+			boxes + 2 * objects.capacity, boxes + 3 * objects.capacity, count, query_region_);
+		for (std::uint32_t i = 0; i < count; i++) {
+			if (objects.Objects()[object_index_ + i] == nullptr) {
+				hit_mask_ |= 1u << i;
+			}
+		}
+		hit_mask_begin_ = object_index_;
+		hit_mask_end_ = object_index_ + count;
+		hit_mask_modifications_ = quadtree_->modifications_;
+	}
+	std::uint32_t hits = hit_mask_ >> (object_index_ - hit_mask_begin_);
+	return hits == 0 ? hit_mask_end_ : object_index_ + detail::CountTrailingZeros(hits);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::Impl::
+MarkIndexedHits() {
+	using Tree = typename quad_tree<Number, Object, BoundingBoxExtractor, Policy>::impl;
+	indexed_hits_.clear();
+	const Bucket& objects = traversal_.GetNode()->objects;
+	// free rides take every entry without a test
+	if (traversal_.GetDepth() >= Tree::kOversizedIndexDepth ||
+			traversal_.GetDepth() >= free_ride_from_level_ ||
+			objects.size < Tree::kOversizedIndexEntries) {
+		return;
+	}
+	indexed_hits_.resize((objects.size + 31) / 32, 0);
+	quadtree_->GetOversizedIndex(objects).MarkTouching(query_region_, indexed_hits_.data());
+	indexed_hits_modifications_ = quadtree_->modifications_;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+std::uint32_t
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::Impl::
+NextIndexedHit() {
+	const Bucket& objects = traversal_.GetNode()->objects;
+	assert(object_index_ < objects.size);
+	if (indexed_hits_modifications_ != quadtree_->modifications_) {
+		// the objects may have moved since, the rest of the node is tested one by one
+		indexed_hits_.clear();
+		return object_index_;
+	}
+	assert(objects.size <= indexed_hits_.size() * 32);
+	for (std::uint32_t i = object_index_ / 32; i < indexed_hits_.size(); i++) {
+		std::uint32_t hits = indexed_hits_[i];
+		if (i == object_index_ / 32) {
+			hits &= ~0u << (object_index_ % 32);
+		}
+		if (hits != 0) {
+			std::uint32_t hit_index = i * 32 + detail::CountTrailingZeros(hits);
+			return hit_index < objects.size ? hit_index : objects.size;
+		}
+	}
+	return objects.size;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::Impl::
+MoveIndexedHit(std::uint32_t from, std::uint32_t to) {
+	if (indexed_hits_.empty() || indexed_hits_modifications_ != quadtree_->modifications_) {
+		indexed_hits_.clear();
+		return;
+	}
+	std::uint32_t hit = (indexed_hits_[from / 32] >> (from % 32)) & 1;
+	indexed_hits_[to / 32] = (indexed_hits_[to / 32] & ~(1u << (to % 32))) | (hit << (to % 32));
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 auto
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::Impl::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::Impl::
 CurrentNodeFits() const -> FitType {
 	const bounding_box<Number>& node_bounds = traversal_.GetNodeBoundingBox();
 	bounding_box<Number> extended_bounds = node_bounds;
-	Number half_width =
-		(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.width / 2);
-	Number half_height =
-		(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.height / 2);
-	extended_bounds.width = (Number)(extended_bounds.width * 2);
-	extended_bounds.height = (Number)(extended_bounds.height * 2);
-	extended_bounds.left = (Number)(extended_bounds.left - half_width);
-	extended_bounds.top = (Number)(extended_bounds.top - half_height);
+	// the objects of the node reach out of it by half of the largest one it takes
+	Number margin_x = quad_tree<Number, Object, BoundingBoxExtractor, Policy>::impl::GetLooseReach(
+		(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.width / 2));
+	Number margin_y = quad_tree<Number, Object, BoundingBoxExtractor, Policy>::impl::GetLooseReach(
+		(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.height / 2));
+	// the loose bounds must not wrap around, unsigned numbers stop at 0
+	const Number lowest = std::numeric_limits<Number>::lowest();
+	extended_bounds.left = node_bounds.left >= (Number)(lowest + margin_x) ?
+		(Number)(node_bounds.left - margin_x) : lowest;
+	extended_bounds.top = node_bounds.top >= (Number)(lowest + margin_y) ?
+		(Number)(node_bounds.top - margin_y) : lowest;
+	extended_bounds.width = (Number)(node_bounds.left + node_bounds.width + margin_x - extended_bounds.left);
+	extended_bounds.height = (Number)(node_bounds.top + node_bounds.height + margin_y - extended_bounds.top);
 	switch (query_type_) {
 	case QueryType::kIntersects:
 		if (!query_region_.intersects(extended_bounds)) {
@@ -995,137 +2580,950 @@ CurrentNodeFits() const -> FitType {
 
 
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
-impl() :
-	root_(nullptr), bounding_box_(0, 0, 0, 0),
-	object_pointers_(64, std::hash<Object*>(), std::equal_to<Object*>(),
-		detail::BlocksAllocatorAdaptor<std::pair<const Object*, Object**>>(allocator_)),
-	number_of_objects_(0), maximal_depth_(kInternalMinDepth),
-	running_queries_(0) {
-	assert(maximal_depth_ < kInternalMaxDepth);
-	//object_pointers_.reserve(64);
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+impl() : impl(nullptr) {
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+impl(memory_resource* resource) :
+	own_resource_(resource == nullptr ? new blocks_memory_resource() : nullptr),
+	own_node_resource_(resource == nullptr ? new blocks_memory_resource() : nullptr),
+	resource_(resource == nullptr ? own_resource_.get() : resource),
+	node_resource_(resource == nullptr ? own_node_resource_.get() : resource),
+	// compact nodes live in chunks of the general resource, so Clear can reset
+	// the node resource and keep the chunks for the next nodes
+	nodes_(Policy::compact_nodes ? resource_ : node_resource_),
+	root_(), bounding_box_(0, 0, 0, 0),
+	object_slots_(resource_),
+	number_of_objects_(0), maximal_depth_(kStartDepth),
+	running_queries_(0), modifications_(0), root_growths_(0), fat_margin_(0),
+	reserved_bounds_(0, 0, 0, 0), maintenance_root_growths_(0), splitting_node_(),
+	oversized_index_uses_(0) {
+	assert(maximal_depth_ <= kInternalMaxDepth);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
 ~impl() {
-	DeleteTree();
+	Clear();
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 bool
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
 Insert(Object* object) {
-	bool was_removed = Remove(object);
-	Object** place = InsertIntoTree(object);
-	object_pointers_.emplace(object, place);
-	number_of_objects_++;
-	RecalculateMaximalDepth();
-	return !was_removed;
+	bool inserted;
+	InsertSlot(object, &inserted);
+	return inserted;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 bool
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
 Update(Object* object) {
 	return !Insert(object);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 bool
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
 Remove(Object* object) {
-	auto it = object_pointers_.find(object);
-	if (it != object_pointers_.end()) {
-		assert(*(it->second) == it->first);
-		*(it->second) = nullptr;
-		object_pointers_.erase(it);
-		number_of_objects_--;
-		RecalculateMaximalDepth();
+	Slot* slot = object_slots_.Find(object);
+	if (slot != nullptr) {
+		assert(GetSlotObject(slot) == object);
+		object_slots_.Erase(object);
+		RemoveSlot(slot);
 		return true;
 	}
 	return false;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 bool
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
 Contains(Object* object) const {
-	return object_pointers_.find(object) != object_pointers_.end();
+	return object_slots_.Find(object) != nullptr;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+auto
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+InsertWithHandle(Object* object) -> handle {
+	bool inserted;
+	return handle(InsertSlot(object, &inserted));
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+Update(handle object_handle) {
+	assert(object_handle);
+	Slot* slot = static_cast<Slot*>(object_handle.slot_);
+	bounding_box<Number> object_bounds(0, 0, 0, 0);
+	BoundingBoxExtractor::ExtractBoundingBox(GetSlotObject(slot), &object_bounds);
+	UpdateSlot(slot, object_bounds);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+Remove(handle object_handle) {
+	assert(object_handle);
+	Slot* slot = static_cast<Slot*>(object_handle.slot_);
+	// erasing from a hash map still hashes, but it is the only lookup left
+	object_slots_.Erase(GetSlotObject(slot));
+	RemoveSlot(slot);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+std::size_t
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+InsertMany(Object* const* objects, std::size_t count) {
+	if (root_ == Link()) {
+		// nothing to share a way down with, built from the top it goes faster
+		Build(objects, count);
+		return (std::size_t)number_of_objects_;
+	}
+	batch_.clear();
+	std::size_t new_objects = 0;
+	for (std::size_t i = 0; i < count; i++) {
+		BatchEntry entry = {0, objects[i], object_slots_.Find(objects[i]), bounding_box<Number>(0, 0, 0, 0)};
+		BoundingBoxExtractor::ExtractBoundingBox(entry.object, &entry.object_bounds);
+		if (entry.slot != nullptr &&
+				static_cast<const SlotFatBox&>(*entry.slot).Contains(entry.object_bounds)) {
+			UpdateSlot(entry.slot, entry.object_bounds); // it stays, nothing to sort
+			continue;
+		}
+		new_objects += entry.slot == nullptr ? 1 : 0;
+		batch_.push_back(entry);
+	}
+	// the depth for all of them at once, single inserts would raise it along the way
+	object_slots_.Reserve((std::size_t)number_of_objects_ + new_objects);
+	number_of_objects_ += (int)new_objects;
+	RecalculateMaximalDepth();
+	for (BatchEntry& entry : batch_) {
+		entry.key = GetBatchKey(GetFatBounds(entry.object_bounds));
+	}
+	std::sort(batch_.begin(), batch_.end(),
+		[](const BatchEntry& a, const BatchEntry& b) { return a.key < b.key; });
+
+	batch_path_.clear();
+	std::size_t inserted = 0;
+	for (BatchEntry& entry : batch_) {
+		if (entry.slot == nullptr) {
+			// the same object twice, the first one has inserted it
+			entry.slot = object_slots_.Find(entry.object);
+		}
+		if (entry.slot != nullptr) {
+			UpdateSlot(entry.slot, entry.object_bounds, &batch_path_);
+		}
+		else {
+			AddSlot(entry.object, entry.object_bounds, &batch_path_);
+			inserted++;
+		}
+	}
+	number_of_objects_ -= (int)(new_objects - inserted);
+	RecalculateMaximalDepth();
+	batch_.clear();
+	return inserted;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+std::size_t
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+RemoveMany(Object* const* objects, std::size_t count) {
+	batch_.clear();
+	for (std::size_t i = 0; i < count; i++) {
+		Slot* slot = object_slots_.Find(objects[i]);
+		if (slot != nullptr) {
+			// erased right away, the same object twice is removed once
+			object_slots_.Erase(objects[i]);
+			std::uint64_t node_address = reinterpret_cast<std::uintptr_t>(ResolveNode(slot->node));
+			batch_.push_back({node_address, objects[i], slot, bounding_box<Number>(0, 0, 0, 0)});
+		}
+	}
+	// the entries of a bucket one after the other
+	std::sort(batch_.begin(), batch_.end(),
+		[](const BatchEntry& a, const BatchEntry& b) { return a.key < b.key; });
+	for (BatchEntry& entry : batch_) {
+		modifications_++;
+		DetachSlot(entry.slot);
+		DeleteSlot(entry.slot);
+	}
+	std::size_t removed = batch_.size();
+	number_of_objects_ -= (int)removed;
+	RecalculateMaximalDepth();
+	batch_.clear();
+	return removed;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+Build(Object* const* objects, std::size_t count, const build_executor* executor) {
+	Clear();
+	if (count == 0) {
+		return;
+	}
+	std::vector<BuildEntry> entries(count, BuildEntry{nullptr, bounding_box<Number>(0, 0, 0, 0), 0, 0, 0});
+	if (executor == nullptr) {
+		ExtractBuildEntries(objects, entries.data(), entries.data() + count);
+	}
+	else {
+		std::vector<std::function<void()>> tasks;
+		for (std::size_t first = 0; first < count; first += kBuildTaskEntries) {
+			std::size_t last = count - first > kBuildTaskEntries ? first + kBuildTaskEntries : count;
+			BuildEntry* entries_first = entries.data();
+			tasks.push_back([this, objects, entries_first, first, last]() {
+				ExtractBuildEntries(objects + first, entries_first + first, entries_first + last);
+			});
+		}
+		(*executor)(tasks);
+	}
+	number_of_objects_ = (int)count;
+	RecalculateMaximalDepth();
+	object_slots_.Reserve(count);
+
+	// the root around all the centers at once, single inserts would grow it step by step
+	Number left = entries[0].center_x;
+	Number top = entries[0].center_y;
+	Number right = left;
+	Number bottom = top;
+	Number maximal_object_extent = entries[0].extent;
+	for (const BuildEntry& entry : entries) {
+		left = entry.center_x < left ? entry.center_x : left;
+		top = entry.center_y < top ? entry.center_y : top;
+		right = entry.center_x > right ? entry.center_x : right;
+		bottom = entry.center_y > bottom ? entry.center_y : bottom;
+		maximal_object_extent = entry.extent > maximal_object_extent ? entry.extent : maximal_object_extent;
+	}
+	Number extent = (Number)(right - left) >= (Number)(bottom - top) ?
+		(Number)(right - left) : (Number)(bottom - top);
+	Number maximal_object_room = detail::ScaleDistance<Number,
+		std::ratio_divide<std::ratio<1>, LooseReach>>::Apply(maximal_object_extent);
+	extent = extent >= maximal_object_room ? extent : maximal_object_room;
+	Number margin = (Number)((typename detail::MakeDistance<Number>::Type)extent / 8);
+	margin = margin > 0 ? margin : kMinimalObjectExtent;
+	bounding_box_ = bounding_box<Number>((Number)(left - margin), (Number)(top - margin),
+		(Number)(extent + 2 * margin), (Number)(extent + 2 * margin));
+	// centers on the right and bottom sides have to be inside too
+	while (!bounding_box_.contains(right, bottom) ||
+			maximal_object_extent > GetLooseReach(bounding_box_.width)) {
+		bounding_box_.width = (Number)(bounding_box_.width * 2);
+		bounding_box_.height = bounding_box_.width;
+	}
+	if (GetLooseReach(reserved_bounds_.width) >= maximal_object_extent && reserved_bounds_.contains(left, top) &&
+			reserved_bounds_.contains(right, bottom)) {
+		bounding_box_ = reserved_bounds_;
+	}
+	assert(bounding_box_.left < bounding_box_.left + bounding_box_.width);
+	assert(bounding_box_.top < bounding_box_.top + bounding_box_.height);
+
+	// sorting the entries needs no node yet, so the subtrees below the top levels can be
+	// sorted apart, while the nodes come from a single thread (the pools are not thread-safe)
+	std::vector<BuildRecord> records;
+	std::vector<BuildSubtree> subtrees;
+	SortBuildEntries(bounding_box_, 0, entries.data(), entries.data() + entries.size(),
+		&records, executor == nullptr ? nullptr : &subtrees);
+	if (!subtrees.empty()) {
+		std::vector<std::function<void()>> tasks;
+		for (BuildSubtree& subtree : subtrees) {
+			BuildSubtree* sorted_subtree = &subtree;
+			tasks.push_back([this, sorted_subtree]() {
+				SortBuildEntries(sorted_subtree->node_bounds, sorted_subtree->depth,
+					sorted_subtree->first, sorted_subtree->last, &sorted_subtree->records, nullptr);
+			});
+		}
+		(*executor)(tasks);
+	}
+
+	modifications_++;
+	root_ = NewNode();
+	Cell cell;
+	cell.left = bounding_box_.left;
+	cell.top = bounding_box_.top;
+	cell.right = (Number)(bounding_box_.left + bounding_box_.width);
+	cell.bottom = (Number)(bounding_box_.top + bounding_box_.height);
+	cell.maximal_extent = GetLooseReach(bounding_box_.width);
+	cell.root_growths = root_growths_;
+	BuildEntry* next_entry = entries.data();
+	BuildNode(records.data(), subtrees, root_, bounding_box_, 0, cell, &next_entry);
+	assert(next_entry == entries.data() + entries.size());
+	RecalculateMaximalDepth();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+auto
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+QueryIntersectsRegion(const bounding_box<Number>& region) -> query {
+	typename query::Impl* query_impl = GetAvailableQueryFromPool();
+	query_impl->Acquire(this, &region, query::Impl::QueryType::kIntersects);
+	return query(query_impl);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+auto
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+QueryInsideRegion(const bounding_box<Number>& region) -> query {
+	typename query::Impl* query_impl = GetAvailableQueryFromPool();
+	query_impl->Acquire(this, &region, query::Impl::QueryType::kInside);
+	return query(query_impl);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+auto
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+QueryContainsRegion(const bounding_box<Number>& region) -> query {
+	typename query::Impl* query_impl = GetAvailableQueryFromPool();
+	query_impl->Acquire(this, &region, query::Impl::QueryType::kContains);
+	return query(query_impl);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+const bounding_box<NumberT>&
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+GetBoundingBox() const {
+	return bounding_box_;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+ForceCleanup() {
+	query query = QueryIntersectsRegion(bounding_box_);
+	while (!query.end_of_query()) {
+    query.next();
+	}
+	if (own_resource_ != nullptr) {
+		own_resource_->release_free_blocks();
+		own_node_resource_->release_free_blocks();
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+memory_stats
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+GetMemoryStats() const {
+	memory_stats stats;
+	if (own_resource_ != nullptr) {
+		stats.own_pool = own_resource_->get_stats();
+		for (const blocks_stats::size_class& node_size_class :
+				own_node_resource_->get_stats().size_classes) {
+			auto it = std::find_if(stats.own_pool.size_classes.begin(), stats.own_pool.size_classes.end(),
+				[&](const blocks_stats::size_class& size_class) {
+					return size_class.slot_size == node_size_class.slot_size;
+				});
+			if (it == stats.own_pool.size_classes.end()) {
+				stats.own_pool.size_classes.push_back(node_size_class);
+			}
+			else {
+				it->blocks += node_size_class.blocks;
+				it->live_slots += node_size_class.live_slots;
+				it->free_slots += node_size_class.free_slots;
+			}
+		}
+		blocks_stats node_stats = own_node_resource_->get_stats();
+		stats.own_pool.upstream_allocations += node_stats.upstream_allocations;
+		stats.own_pool.upstream_bytes += node_stats.upstream_bytes;
+	}
+
+	std::vector<Link> nodes_to_visit;
+	if (root_ != Link()) {
+		nodes_to_visit.push_back(root_);
+	}
+	while (!nodes_to_visit.empty()) {
+		Node* node = ResolveNode(nodes_to_visit.back());
+		nodes_to_visit.pop_back();
+		stats.nodes++;
+		const Bucket& objects = node->objects;
+		for (std::uint32_t i = 0; i < objects.size; i++) {
+			stats.object_slots++;
+			if (objects.Objects()[i] == nullptr) {
+				stats.tombstones++;
+			}
+		}
+		stats.object_slot_bytes += objects.capacity * BucketEntrySize();
+		for (Link child :
+				{node->top_left, node->top_right, node->bottom_right, node->bottom_left}) {
+			if (child != Link()) {
+				nodes_to_visit.push_back(child);
+			}
+		}
+	}
+	stats.node_bytes = stats.nodes * sizeof(Node);
+	stats.object_slot_bytes += number_of_objects_ * sizeof(Slot);
+
+	stats.object_pointer_buckets = object_slots_.GetBucketCount();
+	stats.object_pointer_bytes = object_slots_.GetBytes();
+
+	stats.query_pool_size = query_pool_.size();
+	stats.query_pool_bytes = query_pool_.size() * sizeof(typename query::Impl);
+	return stats;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+int
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+GetSize() const {
+	return number_of_objects_;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+Reserve(std::size_t objects) {
+	object_slots_.Reserve(objects);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+ReserveBounds(const bounding_box<Number>& bounds) {
+	assert(bounds.width >= 0 && bounds.height >= 0);
+	Number extent = bounds.width >= bounds.height ? bounds.width : bounds.height;
+	reserved_bounds_ = bounding_box<Number>(bounds.left, bounds.top, extent, extent);
+	if (extent == 0) {
+		return;
+	}
+	if (root_ == Link()) {
+		bounding_box_ = reserved_bounds_;
+		root_ = NewNode();
+		return;
+	}
+	// towards the sides left out, the root stays where its contents are
+	while (!bounding_box_.contains(reserved_bounds_)) {
+		GrowRoot(reserved_bounds_.left < bounding_box_.left ?
+				reserved_bounds_.left : (Number)(reserved_bounds_.left + reserved_bounds_.width),
+			reserved_bounds_.top < bounding_box_.top ?
+				reserved_bounds_.top : (Number)(reserved_bounds_.top + reserved_bounds_.height));
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+ShrinkBounds() {
+	if (running_queries_ == 0) {
+		ShrinkRoot();
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+bool
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+Maintain(std::size_t budget_nodes) {
+	if (maintenance_root_growths_ != root_growths_) {
+		// the path leads somewhere else below another root
+		maintenance_path_.clear();
+		maintenance_root_growths_ = root_growths_;
+	}
+	if (root_ == Link()) {
+		maintenance_path_.clear();
+		return true;
+	}
+
+	// back down to where the last call stopped, as far as the nodes are still there
+	std::vector<MaintenanceStep> way;
+	way.push_back({root_, bounding_box_, -1});
+	for (std::size_t level = 0; level < maintenance_path_.size(); level++) {
+		way.back().child = maintenance_path_[level];
+		if (level + 1 == maintenance_path_.size() || way.back().child < 0) {
+			break;
+		}
+		Link child_link = GetChildLink(ResolveNode(way.back().node), way.back().child);
+		if (child_link == Link()) {
+			break;
+		}
+		way.push_back({child_link, GetChildBounds(way.back().node_bounds, way.back().child), -1});
+	}
+
+	// children first, so the nodes they leave empty can go in the same pass
+	while (budget_nodes > 0) {
+		MaintenanceStep& step = way.back();
+		Node* node = ResolveNode(step.node);
+		int child = step.child + 1;
+		while (child < 4 && GetChildLink(node, child) == Link()) {
+			child++;
+		}
+		if (child < 4) {
+			step.child = child;
+			way.push_back({GetChildLink(node, child), GetChildBounds(step.node_bounds, child), -1});
+			continue;
+		}
+		Link link = step.node;
+		way.pop_back();
+		budget_nodes--;
+		if (way.empty()) {
+			MaintainNode(link, 0, nullptr);
+			if (running_queries_ == 0) {
+				ShrinkRoot();
+			}
+			maintenance_path_.clear();
+			maintenance_root_growths_ = root_growths_;
+			return true;
+		}
+		MaintainNode(link, (int)way.size(),
+			&GetChildLink(ResolveNode(way.back().node), way.back().child));
+	}
+	maintenance_path_.clear();
+	for (const MaintenanceStep& step : way) {
+		maintenance_path_.push_back(step.child);
+	}
+	return false;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+SetFatMargin(Number margin) {
+	assert(margin >= 0);
+	fat_margin_ = margin;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+NumberT
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+GetFatMargin() const {
+	return fat_margin_;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+Clear() {
+	modifications_++;
+	oversized_indexes_.clear();
+	if (own_node_resource_ != nullptr) {
+		// Every node, bucket and slot lives in the private node pool and
+		// destroying them would only give their memory back to that pool,
+		// so the whole pool is reset at once instead of walking the tree
+		ForgetObjects();
+		root_ = Link();
+		nodes_.Reset();
+		own_node_resource_->reset();
+		bounding_box_ = bounding_box<Number>(0, 0, 0, 0);
+		number_of_objects_ = 0;
+		maximal_depth_ = kStartDepth;
+	}
+	else {
+		DeleteTree();
+	}
+}
+
+
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+auto
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+ResolveNode(Link link) const -> Node* {
+	return NodePool::Resolve(&nodes_, link);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+auto
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+NewNode() -> Link {
+	return nodes_.New();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+DeleteNode(Link link) {
+	Bucket& objects = ResolveNode(link)->objects;
+	for (std::uint32_t i = 0; i < objects.size; i++) {
+		if (objects.Slots()[i] != nullptr) {
+			DeleteSlot(static_cast<Slot*>(objects.Slots()[i]));
+		}
+	}
+	DropOversizedIndex(objects);
+	DeleteBucket(objects);
+	nodes_.Delete(link);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+auto
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+NewSlot() -> Slot* {
+	void* memory = node_resource_->allocate(sizeof(Slot), alignof(Slot));
+	return new(memory) Slot();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+DeleteSlot(Slot* slot) {
+	node_resource_->deallocate(slot, sizeof(Slot), alignof(Slot));
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+std::size_t
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+BucketEntrySize() {
+	return sizeof(Object*) + sizeof(Slot*) +
+		(Policy::cache_bounding_boxes ? 4 * sizeof(Number) : 0);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+std::size_t
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+BucketAlignment() {
+	return alignof(Number) > alignof(Object*) ? alignof(Number) : alignof(Object*);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+NumberT*
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+BucketBoxes(const Bucket& bucket) {
+	assert(Policy::cache_bounding_boxes);
+	// capacities are even, which keeps the boxes after the pointer arrays aligned
+	return reinterpret_cast<Number*>(bucket.Slots() + bucket.capacity);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+SetCachedBoundingBox(const Bucket& bucket, std::uint32_t index,
+		const bounding_box<Number>& object_bounds) {
+	Number* boxes = BucketBoxes(bucket);
+	boxes[index] = object_bounds.left;
+	boxes[bucket.capacity + index] = object_bounds.top;
+	boxes[2 * bucket.capacity + index] = object_bounds.width;
+	boxes[3 * bucket.capacity + index] = object_bounds.height;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+AddToBucket(Link link, Object* object,
+		const bounding_box<Number>& object_bounds, Slot* slot) {
+	Bucket& objects = ResolveNode(link)->objects;
+	// queries never stop on a tombstone, so reusing the last one moves nothing under them
+	if (!objects.Empty() && objects.Objects()[objects.size - 1] == nullptr) {
+		objects.size--;
+	}
+	if (objects.size == objects.capacity) {
+		GrowBucket(objects, objects.capacity == 0 ? 2 : objects.capacity * 2);
+	}
+	std::uint32_t index = objects.size++;
+	objects.Objects()[index] = object;
+	objects.Slots()[index] = slot;
+	if (Policy::cache_bounding_boxes) {
+		SetCachedBoundingBox(objects, index, object_bounds);
+	}
+	slot->node = link;
+	slot->index = index;
+	TouchOversizedIndex(objects);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+RemoveFromBucket(Bucket& bucket, std::uint32_t index) {
+	assert(index < bucket.size);
+	std::uint32_t last = bucket.size - 1;
+	if (index != last) {
+		bucket.Objects()[index] = bucket.Objects()[last];
+		bucket.Slots()[index] = bucket.Slots()[last];
+		if (bucket.Slots()[index] != nullptr) {
+			bucket.Slots()[index]->index = index;
+		}
+		if (Policy::cache_bounding_boxes) {
+			Number* boxes = BucketBoxes(bucket);
+			for (std::uint32_t i = 0; i < 4 * bucket.capacity; i += bucket.capacity) {
+				boxes[i + index] = boxes[i + last];
+			}
+		}
+	}
+	bucket.size--;
+	TouchOversizedIndex(bucket);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+DetachSlot(Slot* slot) {
+	Bucket& objects = ResolveNode(slot->node)->objects;
+	assert(objects.Slots()[slot->index] == slot);
+	if (running_queries_ == 0) {
+		RemoveFromBucket(objects, slot->index);
+	}
+	else {
+		// running queries keep positions in the buckets, they clean up later
+		objects.Objects()[slot->index] = nullptr;
+		objects.Slots()[slot->index] = nullptr;
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+auto
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+GetOversizedIndex(const Bucket& bucket) -> const detail::SortedBoxIndex<Number>& {
+	OversizedIndex* index = nullptr;
+	for (OversizedIndex& existing : oversized_indexes_) {
+		if (existing.bucket == &bucket) {
+			index = &existing;
+			break;
+		}
+	}
+	if (index == nullptr) {
+		if (oversized_indexes_.size() < kOversizedIndexes) {
+			oversized_indexes_.emplace_back(resource_);
+			index = &oversized_indexes_.back();
+		}
+		else {
+			// the root grew over the others or they are empty by now
+			index = &*std::min_element(oversized_indexes_.begin(), oversized_indexes_.end(),
+				[](const OversizedIndex& index1, const OversizedIndex& index2) {
+					return index1.last_use < index2.last_use;
+				});
+		}
+		index->bucket = &bucket;
+		index->stale = true;
+	}
+	index->last_use = ++oversized_index_uses_;
+	if (index->stale) {
+		index->boxes.Clear();
+		for (std::uint32_t i = 0; i < bucket.size; i++) {
+			if (bucket.Objects()[i] != nullptr) {
+				bounding_box<Number> object_bounds(0, 0, 0, 0);
+				BoundingBoxExtractor::ExtractBoundingBox(bucket.Objects()[i], &object_bounds);
+				index->boxes.Add(object_bounds, i);
+			}
+		}
+		index->boxes.Sort();
+		index->stale = false;
+	}
+	return index->boxes;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+TouchOversizedIndex(const Bucket& bucket) {
+	for (OversizedIndex& index : oversized_indexes_) {
+		if (index.bucket == &bucket) {
+			index.stale = true;
+		}
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+DropOversizedIndex(const Bucket& bucket) {
+	for (OversizedIndex& index : oversized_indexes_) {
+		if (index.bucket == &bucket) {
+			// a new node may get the same place
+			index.bucket = nullptr;
+			index.last_use = 0;
+		}
+	}
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 auto
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
-QueryIntersectsRegion(const bounding_box<Number>& region) -> query {
-	typename query::Impl* query_impl = GetAvailableQueryFromPool();
-	query_impl->Acquire(this, &region, query::Impl::QueryType::kIntersects);
-	return query(query_impl);
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+InsertSlot(Object* object, bool* inserted) -> Slot* {
+	bounding_box<Number> object_bounds(0, 0, 0, 0);
+	BoundingBoxExtractor::ExtractBoundingBox(object, &object_bounds);
+	Slot* existing_slot = object_slots_.Find(object);
+	if (existing_slot != nullptr) {
+		UpdateSlot(existing_slot, object_bounds);
+		*inserted = false;
+		return existing_slot;
+	}
+	Slot* slot = AddSlot(object, object_bounds);
+	number_of_objects_++;
+	RecalculateMaximalDepth();
+	*inserted = true;
+	return slot;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 auto
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
-QueryInsideRegion(const bounding_box<Number>& region) -> query {
-	typename query::Impl* query_impl = GetAvailableQueryFromPool();
-	query_impl->Acquire(this, &region, query::Impl::QueryType::kInside);
-	return query(query_impl);
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+AddSlot(Object* object, const bounding_box<Number>& object_bounds, Path* path) -> Slot* {
+	modifications_++;
+	bounding_box<Number> fat_bounds = GetFatBounds(object_bounds);
+	if (Policy::node_capacity > 0 && path == nullptr) {
+		// the objects of a split take the same way down again
+		split_path_.clear();
+		path = &split_path_;
+	}
+	Cell cell;
+	Link node = GetNodeFor(fat_bounds, &cell, path);
+	Slot* slot = NewSlot();
+	static_cast<SlotCell&>(*slot) = cell;
+	static_cast<SlotFatBox&>(*slot) = FatBox(fat_bounds);
+	AddToBucket(node, object, object_bounds, slot);
+	object_slots_.Insert(object, slot);
+	if (splitting_node_ != Link()) {
+		SplitNode(splitting_node_, path);
+	}
+	return slot;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-auto
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
-QueryContainsRegion(const bounding_box<Number>& region) -> query {
-	typename query::Impl* query_impl = GetAvailableQueryFromPool();
-	query_impl->Acquire(this, &region, query::Impl::QueryType::kContains);
-	return query(query_impl);
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+UpdateSlot(Slot* slot, const bounding_box<Number>& object_bounds, Path* path) {
+	const SlotFatBox& slot_fat_box = *slot;
+	// moves inside the fat box change nothing but the cached box
+	if (slot_fat_box.Contains(object_bounds)) {
+		modifications_++;
+		if (Policy::cache_bounding_boxes) {
+			SetCachedBoundingBox(ResolveNode(slot->node)->objects, slot->index, object_bounds);
+		}
+		TouchOversizedIndex(ResolveNode(slot->node)->objects);
+		return;
+	}
+	RelocateSlot(slot, object_bounds, path);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-const bounding_box<NumberT>&
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
-GetBoundingBox() const {
-	return bounding_box_;
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+RelocateSlot(Slot* slot, const bounding_box<Number>& object_bounds, Path* path) {
+	modifications_++;
+	bounding_box<Number> fat_bounds = GetFatBounds(object_bounds);
+	static_cast<SlotFatBox&>(*slot) = FatBox(fat_bounds);
+	Number center_x, center_y, extent;
+	GetCenterAndExtent(fat_bounds, &center_x, &center_y, &extent);
+	Link node = slot->node;
+	SlotCell& slot_cell = *slot;
+	// most moves stay inside the cell of the node, which spares the descent
+	if (!slot_cell.Admits(center_x, center_y, extent, maximal_depth_, root_growths_)) {
+		if (Policy::node_capacity > 0 && path == nullptr) {
+			split_path_.clear();
+			path = &split_path_;
+		}
+		Cell cell;
+		node = GetNodeFor(fat_bounds, &cell, path, slot->node);
+		slot_cell = cell;
+	}
+	if (node == slot->node) {
+		// keeping the entry also means running queries do not meet it twice
+		if (Policy::cache_bounding_boxes) {
+			SetCachedBoundingBox(ResolveNode(node)->objects, slot->index, object_bounds);
+		}
+		TouchOversizedIndex(ResolveNode(node)->objects);
+	}
+	else {
+		Object* object = GetSlotObject(slot);
+		DetachSlot(slot);
+		AddToBucket(node, object, object_bounds, slot);
+	}
+	if (splitting_node_ != Link()) {
+		SplitNode(splitting_node_, path);
+	}
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 void
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
-ForceCleanup() {
-	query query = QueryIntersectsRegion(bounding_box_);
-	while (!query.end_of_query()) {
-    query.next();
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+SplitNode(Link link, Path* path) {
+	assert(running_queries_ == 0);
+	splitting_node_ = Link();
+	Bucket& objects = ResolveNode(link)->objects;
+	for (std::uint32_t i = objects.size; i > 0; i--) {
+		if (i > objects.size || objects.Objects()[i - 1] == nullptr) {
+			continue; // tombstones of finished queries wait for the cleanup
+		}
+		// the descent does not stop at the node any more, the objects of its size stay
+		Slot* slot = static_cast<Slot*>(objects.Slots()[i - 1]);
+		bounding_box<Number> object_bounds(0, 0, 0, 0);
+		BoundingBoxExtractor::ExtractBoundingBox(objects.Objects()[i - 1], &object_bounds);
+		bounding_box<Number> fat_bounds = GetFatBounds(object_bounds);
+		Cell cell;
+		Link node = GetNodeFor(fat_bounds, &cell, path);
+		static_cast<SlotCell&>(*slot) = cell;
+		static_cast<SlotFatBox&>(*slot) = FatBox(fat_bounds);
+		if (node != link) {
+			Object* object = GetSlotObject(slot);
+			DetachSlot(slot);
+			AddToBucket(node, object, object_bounds, slot);
+		}
+		else {
+			if (Policy::cache_bounding_boxes) {
+				SetCachedBoundingBox(objects, slot->index, object_bounds);
+			}
+			TouchOversizedIndex(objects);
+		}
+		if (splitting_node_ != Link()) {
+			SplitNode(splitting_node_, path); // a child filled up on the way
+		}
 	}
-	allocator_.ReleaseFreeBlocks();
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-int
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
-GetSize() const {
-	return number_of_objects_;
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+RemoveSlot(Slot* slot) {
+	modifications_++;
+	DetachSlot(slot);
+	DeleteSlot(slot);
+	number_of_objects_--;
+	RecalculateMaximalDepth();
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-void
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
-Clear() {
-	DeleteTree();
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+auto
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+GetSlotObject(const Slot* slot) const -> Object* {
+	Object* object = ResolveNode(slot->node)->objects.Objects()[slot->index];
+	assert(object != nullptr);
+	return object;
 }
 
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+GrowBucket(Bucket& bucket, std::uint32_t capacity) {
+	assert(capacity % 2 == 0 && capacity >= bucket.size);
+	Bucket grown;
+	grown.capacity = capacity;
+	grown.size = bucket.size;
+	grown.data = node_resource_->allocate(grown.capacity * BucketEntrySize(), BucketAlignment());
+	if (bucket.size > 0) {
+		std::memcpy(grown.Objects(), bucket.Objects(), bucket.size * sizeof(Object*));
+		std::memcpy(grown.Slots(), bucket.Slots(), bucket.size * sizeof(Slot*));
+		if (Policy::cache_bounding_boxes) {
+			for (std::uint32_t i = 0; i < 4; i++) {
+				std::memcpy(BucketBoxes(grown) + i * grown.capacity,
+					BucketBoxes(bucket) + i * bucket.capacity, bucket.size * sizeof(Number));
+			}
+		}
+	}
+	DeleteBucket(bucket);
+	bucket = grown;
+}
 
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+DeleteBucket(Bucket& bucket) {
+	if (bucket.data != nullptr) {
+		node_resource_->deallocate(bucket.data, bucket.capacity * BucketEntrySize(), BucketAlignment());
+	}
+	bucket = Bucket();
+}
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 void
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
 RecalculateMaximalDepth() {
+	if (Policy::node_capacity > 0) {
+		return;
+	}
 	do {
-		if (maximal_depth_ < kInternalMaxDepth &&
+		if (maximal_depth_ < Policy::maximal_depth &&
 				number_of_objects_ > 1ll << (maximal_depth_ << 1)) {
 			maximal_depth_++;
 		}
-		else if (maximal_depth_ > kInternalMinDepth &&
+		else if (maximal_depth_ > Policy::minimal_depth &&
 				number_of_objects_ <= 1ll << ((maximal_depth_ - 1) << 1)) {
 			maximal_depth_--;
 		}
@@ -1135,223 +3533,328 @@ RecalculateMaximalDepth() {
 	} while (true);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 void
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+ForgetObjects() {
+	if (ObjectSlots::kStoredInObjects) {
+		std::vector<Link> nodes_to_visit;
+		if (root_ != Link()) {
+			nodes_to_visit.push_back(root_);
+		}
+		while (!nodes_to_visit.empty()) {
+			Node* node = ResolveNode(nodes_to_visit.back());
+			nodes_to_visit.pop_back();
+			const Bucket& objects = node->objects;
+			for (std::uint32_t i = 0; i < objects.size; i++) {
+				if (objects.Objects()[i] != nullptr) {
+					object_slots_.Forget(objects.Objects()[i]);
+				}
+			}
+			for (Link child :
+					{node->top_left, node->top_right, node->bottom_right, node->bottom_left}) {
+				if (child != Link()) {
+					nodes_to_visit.push_back(child);
+				}
+			}
+		}
+	}
+	object_slots_.Clear();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
 DeleteTree() {
-	object_pointers_.clear();
-	detail::FullTreeTraversal<Number, Object>& trav = internal_traversal_;
-	trav.StartAt(root_, bounding_box_);
-	while (root_ != nullptr) {
+	ForgetObjects();
+	detail::FullTreeTraversal<Number, Object, NodePool>& trav = internal_traversal_;
+	trav.StartAt(ResolveNode(root_), bounding_box_, &nodes_);
+	while (root_ != Link()) {
 		assert(trav.GetDepth() >= 0 && trav.GetDepth() <= kInternalMaxDepth);
-		detail::TreeNode<Object>* node = trav.GetNode();
-		if (node->top_left != nullptr) {
+		Node* node = trav.GetNode();
+		if (node->top_left != Link()) {
 			trav.GoTopLeft();
 		}
-		else if (node->top_right != nullptr) {
+		else if (node->top_right != Link()) {
 			trav.GoTopRight();
 		}
-		else if (node->bottom_right != nullptr) {
+		else if (node->bottom_right != Link()) {
 			trav.GoBottomRight();
 		}
-		else if (node->bottom_left != nullptr) {
+		else if (node->bottom_left != Link()) {
 			trav.GoBottomLeft();
 		}
 		else {
 			if (trav.GetDepth() > 0) {
 				trav.GoUp();
+				Link link = Link();
 				switch (trav.GetNodeCurrentChild()) {
 				case detail::ChildPosition::kNone:
 					assert(false);
 					break;
 				case detail::ChildPosition::kTopLeft:
-					assert(node == trav.GetNode()->top_left);
-					trav.GetNode()->top_left = nullptr;
+					link = trav.GetNode()->top_left;
+					trav.GetNode()->top_left = Link();
 					break;
 				case detail::ChildPosition::kTopRight:
-					assert(node == trav.GetNode()->top_right);
-					trav.GetNode()->top_right = nullptr;
+					link = trav.GetNode()->top_right;
+					trav.GetNode()->top_right = Link();
 					break;
 				case detail::ChildPosition::kBottomRight:
-					assert(node == trav.GetNode()->bottom_right);
-					trav.GetNode()->bottom_right = nullptr;
+					link = trav.GetNode()->bottom_right;
+					trav.GetNode()->bottom_right = Link();
 					break;
 				case detail::ChildPosition::kBottomLeft:
-					assert(node == trav.GetNode()->bottom_left);
-					trav.GetNode()->bottom_left = nullptr;
+					link = trav.GetNode()->bottom_left;
+					trav.GetNode()->bottom_left = Link();
 					break;
 				}
-				allocator_.Delete(node);
+				assert(node == ResolveNode(link));
+				DeleteNode(link);
 			}
 			else {
-				assert(node == root_);
-				allocator_.Delete(root_);
-				root_ = nullptr;
+				assert(node == ResolveNode(root_));
+				DeleteNode(root_);
+				root_ = Link();
 			}
 		}
 	}
 
 	bounding_box_ = bounding_box<Number>(0, 0, 0, 0);
 	number_of_objects_ = 0;
-	maximal_depth_ = kInternalMinDepth;
+	maximal_depth_ = kStartDepth;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-ObjectT**
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
-InsertIntoTree(Object* object) {
-	bounding_box<Number> object_bounds(0, 0, 0, 0);
-	BoundingBoxExtractor::ExtractBoundingBox(object, &object_bounds);
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+auto
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+GetFatBounds(const bounding_box<Number>& object_bounds) const -> bounding_box<Number> {
+	if (!Policy::fat_bounding_boxes || fat_margin_ == 0) {
+		return object_bounds;
+	}
+	// the fat box must not wrap around, unsigned numbers stop at 0
+	const Number lowest = std::numeric_limits<Number>::lowest();
+	bounding_box<Number> fat_bounds = object_bounds;
+	fat_bounds.left = object_bounds.left >= (Number)(lowest + fat_margin_) ?
+		(Number)(object_bounds.left - fat_margin_) : lowest;
+	fat_bounds.top = object_bounds.top >= (Number)(lowest + fat_margin_) ?
+		(Number)(object_bounds.top - fat_margin_) : lowest;
+	fat_bounds.width = (Number)(object_bounds.left + object_bounds.width + fat_margin_ - fat_bounds.left);
+	fat_bounds.height = (Number)(object_bounds.top + object_bounds.height + fat_margin_ - fat_bounds.top);
+	return fat_bounds;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+GetCenterAndExtent(const bounding_box<Number>& object_bounds,
+		Number* center_x, Number* center_y, Number* extent) {
 	assert(object_bounds.width >= 0);
 	assert(object_bounds.height >= 0);
 	assert(object_bounds.left <= object_bounds.left + object_bounds.width);
 	assert(object_bounds.top <= object_bounds.top + object_bounds.height);
-	Number maximal_object_extent = object_bounds.width >= object_bounds.height ?
+	*extent = object_bounds.width >= object_bounds.height ?
 		object_bounds.width : object_bounds.height;
-	if (maximal_object_extent < kMinimalObjectExtent) {
-		maximal_object_extent = kMinimalObjectExtent;
+	if (*extent < kMinimalObjectExtent) {
+		*extent = kMinimalObjectExtent;
 	}
-	Number object_center_x = (Number)(object_bounds.left +
+	*center_x = (Number)(object_bounds.left +
 		(Number)((typename detail::MakeDistance<Number>::Type)object_bounds.width / 2));
-	Number object_center_y = (Number)(object_bounds.top +
+	*center_y = (Number)(object_bounds.top +
 		(Number)((typename detail::MakeDistance<Number>::Type)object_bounds.height / 2));
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+NumberT
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+GetLooseReach(Number extent) {
+	return detail::ScaleDistance<Number, LooseReach>::Apply(extent);
+}
 
-	if (root_ != nullptr) {
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+std::uint64_t
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+GetBatchKey(const bounding_box<Number>& object_bounds) const {
+	assert(root_ != Link());
+	Number center_x, center_y, extent;
+	GetCenterAndExtent(object_bounds, &center_x, &center_y, &extent);
+	// the center in 24 bit steps across the root, outside of it on its sides
+	const double kSteps = 16777216.0;
+	double scale = kSteps / (double)bounding_box_.width;
+	double x = ((double)center_x - (double)bounding_box_.left) * scale;
+	double y = ((double)center_y - (double)bounding_box_.top) * scale;
+	std::uint32_t step_x = x <= 0 ? 0 : x >= kSteps - 1 ? (std::uint32_t)kSteps - 1 : (std::uint32_t)x;
+	std::uint32_t step_y = y <= 0 ? 0 : y >= kSteps - 1 ? (std::uint32_t)kSteps - 1 : (std::uint32_t)y;
+	// about the depth the descent stops at, the objects of a node get the same key
+	// and come before the ones of the nodes below
+	int depth = std::ilogb((double)GetLooseReach(bounding_box_.width) / (double)extent);
+	depth = depth < 0 ? 0 : depth > maximal_depth_ ? maximal_depth_ : depth;
+	std::uint64_t code = detail::InterleaveBits(step_x, step_y);
+	if (depth < 24) {
+		code &= ~0ull << (2 * (24 - depth));
+	}
+	return (code << 8) | (std::uint64_t)depth;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+auto
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+GetNodeFor(const bounding_box<Number>& object_bounds, Cell* cell, Path* path, Link placed_in) -> Link {
+	Number object_center_x, object_center_y, maximal_object_extent;
+	GetCenterAndExtent(object_bounds, &object_center_x, &object_center_y, &maximal_object_extent);
+
+	if (root_ == Link() && reserved_bounds_.width > 0) {
+		// objects outside grow it like any other root
+		bounding_box_ = reserved_bounds_;
+		root_ = NewNode();
+	}
+	if (root_ != Link()) {
 		assert(number_of_objects_ >= 0);
 		assert(bounding_box_.width > 0);
 		assert(bounding_box_.width == bounding_box_.height);
 
 		int depth_increase = 0;
 		while (!bounding_box_.contains(object_center_x, object_center_y) ||
-				maximal_object_extent > bounding_box_.width) {
-			Number previous_size = bounding_box_.width;
-			bounding_box_.width = (Number)(bounding_box_.width * 2);
-			bounding_box_.height = bounding_box_.width;
-			Number previous_half =
-				(Number)((typename detail::MakeDistance<Number>::Type)previous_size / 2);
-			Number bb_center_x = (Number)(bounding_box_.left + previous_half);
-			Number bb_center_y = (Number)(bounding_box_.top + previous_half);
-			detail::TreeNode<Object>* old_root = root_;
-			root_ = allocator_.New<detail::TreeNode<Object>>(allocator_);
-			if (object_center_x <= bb_center_x) {
-				bounding_box_.left = (Number)(bounding_box_.left - previous_size);
-				if (object_center_y <= bb_center_y) {
-					bounding_box_.top = (Number)(bounding_box_.top - previous_size);
-					root_->bottom_right = old_root;
-				}
-				else {
-					root_->top_right = old_root;
-				}
-			}
-			else {
-				if (object_center_y <= bb_center_y) {
-					bounding_box_.top = (Number)(bounding_box_.top - previous_size);
-					root_->bottom_left = old_root;
-				}
-				else {
-					root_->top_left = old_root;
-				}
-			}
+				maximal_object_extent > GetLooseReach(bounding_box_.width)) {
+			GrowRoot(object_center_x, object_center_y);
 			depth_increase++;
 			assert(depth_increase < kInternalMaxDepth);
 			(void)depth_increase;
-			assert(bounding_box_.left < bounding_box_.left + bounding_box_.width);
-			assert(bounding_box_.top < bounding_box_.top + bounding_box_.height);
-			// If this happens with integral types you are close to get out of bounds
-			// The bounding box of things should be at least 1/8 of the total interval spanned
-			assert(!std::is_integral<Number>::value ||
-				bounding_box_.width < std::numeric_limits<Number>::max() / 8 * 7);
-			assert(!std::is_integral<Number>::value ||
-				bounding_box_.height < std::numeric_limits<Number>::max() / 8 * 7);
 		}
 
-		detail::ForwardTreeTraversal<Number, Object> trav;
-		trav.StartAt(root_, bounding_box_);
+		cell->left = bounding_box_.left;
+		cell->top = bounding_box_.top;
+		cell->right = (Number)(bounding_box_.left + bounding_box_.width);
+		cell->bottom = (Number)(bounding_box_.top + bounding_box_.height);
+		cell->maximal_extent = GetLooseReach(bounding_box_.width);
+		cell->root_growths = root_growths_;
+
+		Link link = root_;
+		bounding_box<Number> start_bounds = bounding_box_;
+		int start_depth = 0;
+		if (path != nullptr) {
+			// the previous descent of a sorted batch went the same way as far as its cells lead
+			while (!path->empty() && ((int)path->size() - 1 > maximal_depth_ ||
+					!path->back().cell.Leads(object_center_x, object_center_y,
+						maximal_object_extent, root_growths_))) {
+				path->pop_back();
+			}
+			if (!path->empty()) {
+				link = path->back().node;
+				start_bounds = path->back().node_bounds;
+				*cell = path->back().cell;
+				start_depth = (int)path->size() - 1;
+				path->pop_back(); // taken again right below
+			}
+		}
+
+		detail::ForwardTreeTraversal<Number, Object, NodePool> trav;
+		trav.StartAt(ResolveNode(link), start_bounds, &nodes_);
 		do {
 			const bounding_box<Number>& node_bounds = trav.GetNodeBoundingBox();
+			if (path != nullptr) {
+				path->push_back({link, node_bounds, *cell});
+			}
 			assert(node_bounds.contains(object_center_x, object_center_y));
 			Number maximal_bb_extent =
 					node_bounds.width >= node_bounds.height ?
 						node_bounds.width : node_bounds.height;
-			Number half_bb_extent =
-				(Number)((typename detail::MakeDistance<Number>::Type)maximal_bb_extent / 2);
-			assert(maximal_object_extent <= maximal_bb_extent);
-
-			if (maximal_object_extent > half_bb_extent ||
-					trav.GetDepth() >= maximal_depth_) {
+			Number children_extent = GetLooseReach(
+				(Number)((typename detail::MakeDistance<Number>::Type)maximal_bb_extent / 2));
+			assert(maximal_object_extent <= GetLooseReach(maximal_bb_extent));
+
+			if (maximal_object_extent > children_extent ||
+					start_depth + trav.GetDepth() >= maximal_depth_) {
+				cell->minimal_extent = children_extent;
+				cell->depth = start_depth + trav.GetDepth();
 				break;
 			}
+			if (Policy::node_capacity > 0 &&
+					start_depth + trav.GetDepth() >= Policy::minimal_depth && IsLeaf(trav.GetNode())) {
+				std::size_t objects_before = trav.GetNode()->objects.size - (link == placed_in ? 1 : 0);
+				if (objects_before < Policy::node_capacity) {
+					// any object of the cell may stay while the node has no children
+					cell->minimal_extent = 0;
+					cell->depth = start_depth + trav.GetDepth();
+					break;
+				}
+				// full, the first child splits it (later if queries are running)
+				if (running_queries_ == 0) {
+					splitting_node_ = link;
+				}
+			}
+			cell->maximal_extent = children_extent;
 
 			Number node_center_x = (Number)(node_bounds.left +
 				(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.width / 2));
 			Number node_center_y = (Number)(node_bounds.top +
 				(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.height / 2));
 
-			detail::TreeNode<Object>** direction;
+			Link* direction;
 			if (object_center_x < node_center_x) {
+				cell->right = node_center_x;
 				if (object_center_y < node_center_y) {
 					direction = &trav.GetNode()->top_left;
+					cell->bottom = node_center_y;
 				}
 				else {
 					direction = &trav.GetNode()->bottom_left;
+					cell->top = node_center_y;
 				}
 			}
 			else {
+				cell->left = node_center_x;
 				if (object_center_y < node_center_y) {
 					direction = &trav.GetNode()->top_right;
+					cell->bottom = node_center_y;
 				}
 				else {
 					direction = &trav.GetNode()->bottom_right;
+					cell->top = node_center_y;
 				}
 			}
 
-			if (*direction == nullptr) {
-				*direction = allocator_.New<detail::TreeNode<Object>>(allocator_);
+			if (*direction == Link()) {
+				*direction = NewNode(); // pools never move nodes
 			}
+			link = *direction;
 
-			if (*direction == trav.GetNode()->top_left) {
+			if (direction == &trav.GetNode()->top_left) {
 				trav.GoTopLeft();
 			}
-			else if (*direction == trav.GetNode()->top_right) {
+			else if (direction == &trav.GetNode()->top_right) {
 				trav.GoTopRight();
 			}
-			else if (*direction == trav.GetNode()->bottom_right) {
+			else if (direction == &trav.GetNode()->bottom_right) {
 				trav.GoBottomRight();
 			}
 			else {
-				assert(*direction == trav.GetNode()->bottom_left);
+				assert(direction == &trav.GetNode()->bottom_left);
 				trav.GoBottomLeft();
 			}
 		} while (true);
 
 #ifndef NDEBUG
 		bounding_box<Number> effective_bounds = trav.GetNodeBoundingBox();
-		Number half_width =
-			(Number)((typename detail::MakeDistance<Number>::Type)effective_bounds.width / 2);
-		Number half_height =
-			(Number)((typename detail::MakeDistance<Number>::Type)effective_bounds.height / 2);
-		effective_bounds.width = (Number)(effective_bounds.width * 2);
-		effective_bounds.height = (Number)(effective_bounds.height * 2);
-		effective_bounds.left = (Number)(effective_bounds.left - half_width);
-		effective_bounds.top = (Number)(effective_bounds.top - half_height);
+		Number margin_x = GetLooseReach(
+			(Number)((typename detail::MakeDistance<Number>::Type)effective_bounds.width / 2));
+		Number margin_y = GetLooseReach(
+			(Number)((typename detail::MakeDistance<Number>::Type)effective_bounds.height / 2));
+		effective_bounds.width = (Number)(effective_bounds.width + 2 * margin_x);
+		effective_bounds.height = (Number)(effective_bounds.height + 2 * margin_y);
+		effective_bounds.left = (Number)(effective_bounds.left - margin_x);
+		effective_bounds.top = (Number)(effective_bounds.top - margin_y);
 		assert(effective_bounds.contains(object_bounds));
 #endif
 
-		typename detail::TreeNode<Object>::ObjectContainer& objects =
-				trav.GetNode()->objects;
-		if (!objects.empty() && objects.front() == nullptr) {
-			objects.front() = object;
-		}
-		else {
-			objects.emplace_front(object);
-		}
-		return &objects.front();
+		return link;
 	}
 	else {
 		assert(number_of_objects_ == 0);
 		{
-			bounding_box_.width =
-				(Number)((typename detail::MakeDistance<Number>::Type)maximal_object_extent * 2 * 7 / 8);
+			// large enough to take the object, too small for its children to take it
+			bounding_box_.width = detail::ScaleDistance<Number,
+				std::ratio_divide<std::ratio<7, 4>, LooseReach>>::Apply(maximal_object_extent);
 			bounding_box_.height = bounding_box_.width;
 			Number extent_half =
 				(Number)((typename detail::MakeDistance<Number>::Type)bounding_box_.width / 2);
@@ -1360,15 +3863,408 @@ InsertIntoTree(Object* object) {
 			assert(bounding_box_.left < bounding_box_.left + bounding_box_.width);
 			assert(bounding_box_.top < bounding_box_.top + bounding_box_.height);
 		}
-		root_ = allocator_.New<detail::TreeNode<Object>>(allocator_);
-		root_->objects.emplace_front(object);
-		return &root_->objects.front();
+		root_ = NewNode();
+		// the object is larger than the children of the root take, a descent would stop right there
+		cell->left = bounding_box_.left;
+		cell->top = bounding_box_.top;
+		cell->right = (Number)(bounding_box_.left + bounding_box_.width);
+		cell->bottom = (Number)(bounding_box_.top + bounding_box_.height);
+		cell->minimal_extent = GetLooseReach(
+			(Number)((typename detail::MakeDistance<Number>::Type)bounding_box_.width / 2));
+		cell->maximal_extent = GetLooseReach(bounding_box_.width);
+		cell->depth = 0;
+		cell->root_growths = root_growths_;
+		return root_;
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+GrowRoot(Number toward_x, Number toward_y) {
+	Number previous_size = bounding_box_.width;
+	bounding_box_.width = (Number)(bounding_box_.width * 2);
+	bounding_box_.height = bounding_box_.width;
+	Number previous_half =
+		(Number)((typename detail::MakeDistance<Number>::Type)previous_size / 2);
+	Number bb_center_x = (Number)(bounding_box_.left + previous_half);
+	Number bb_center_y = (Number)(bounding_box_.top + previous_half);
+	Link old_root = root_;
+	root_ = NewNode();
+	Node* root = ResolveNode(root_);
+	if (toward_x <= bb_center_x) {
+		bounding_box_.left = (Number)(bounding_box_.left - previous_size);
+		if (toward_y <= bb_center_y) {
+			bounding_box_.top = (Number)(bounding_box_.top - previous_size);
+			root->bottom_right = old_root;
+		}
+		else {
+			root->top_right = old_root;
+		}
+	}
+	else {
+		if (toward_y <= bb_center_y) {
+			bounding_box_.top = (Number)(bounding_box_.top - previous_size);
+			root->bottom_left = old_root;
+		}
+		else {
+			root->top_left = old_root;
+		}
+	}
+	root_growths_++;
+	assert(bounding_box_.left < bounding_box_.left + bounding_box_.width);
+	assert(bounding_box_.top < bounding_box_.top + bounding_box_.height);
+	// If this happens with integral types you are close to get out of bounds
+	// The bounding box of things should be at least 1/8 of the total interval spanned
+	assert(!std::is_integral<Number>::value ||
+		bounding_box_.width < std::numeric_limits<Number>::max() / 8 * 7);
+	assert(!std::is_integral<Number>::value ||
+		bounding_box_.height < std::numeric_limits<Number>::max() / 8 * 7);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+ShrinkRoot() {
+	assert(running_queries_ == 0);
+	while (root_ != Link()) {
+		Node* root = ResolveNode(root_);
+		int children = 0;
+		int child = 0;
+		for (int i = 0; i < 4; i++) {
+			if (GetChildLink(root, i) != Link()) {
+				children++;
+				child = i;
+			}
+		}
+		if (!root->objects.Empty() || children != 1) {
+			return;
+		}
+		bounding_box<Number> child_bounds =
+			GetChildBounds(bounding_box_, child);
+		// integral roots of odd sizes have uneven children
+		if (child_bounds.width != child_bounds.height || child_bounds.width < reserved_bounds_.width) {
+			return;
+		}
+		Link child_link = GetChildLink(root, child);
+		DeleteNode(root_);
+		root_ = child_link;
+		bounding_box_ = child_bounds;
+		root_growths_++;
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+MaintainNode(Link link, int depth, Link* parent_link) {
+	Node* node = ResolveNode(link);
+	Bucket& objects = node->objects;
+	if (depth > maximal_depth_ && running_queries_ == 0) {
+		// deeper than the tree goes now, the objects move up like updated ones
+		// (not under running queries, which could have passed the nodes they go to)
+		for (std::uint32_t i = objects.size; i > 0; i--) {
+			if (i <= objects.size && objects.Objects()[i - 1] != nullptr) {
+				bounding_box<Number> object_bounds(0, 0, 0, 0);
+				BoundingBoxExtractor::ExtractBoundingBox(objects.Objects()[i - 1], &object_bounds);
+				RelocateSlot(static_cast<Slot*>(objects.Slots()[i - 1]), object_bounds);
+			}
+		}
+	}
+	// a query reading the node keeps its position in the bucket, the others are done with it
+	// or have not started it yet (and a running query always stops at an entry, so the nodes
+	// on its way are never empty and childless)
+	if (!IsQueryReading(node)) {
+		for (std::uint32_t i = objects.size; i > 0; i--) {
+			if (i <= objects.size && objects.Objects()[i - 1] == nullptr) {
+				RemoveFromBucket(objects, i - 1);
+			}
+		}
+	}
+	if (Policy::node_capacity > 0 && running_queries_ == 0 && !IsLeaf(node) &&
+			depth >= Policy::minimal_depth && depth < maximal_depth_) {
+		MergeOrSplitNode(link);
+	}
+	if (objects.Empty() && IsLeaf(node)) {
+		DeleteNode(link);
+		if (parent_link != nullptr) {
+			*parent_link = Link();
+		}
+		else {
+			assert(number_of_objects_ == 0);
+			root_ = Link();
+			bounding_box_ = bounding_box<Number>(0, 0, 0, 0);
+		}
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+MergeOrSplitNode(Link link) {
+	assert(running_queries_ == 0);
+	Node* node = ResolveNode(link);
+	Link children[4];
+	std::size_t objects_below = 0;
+	bool leaves = true;
+	for (int child = 0; child < 4; child++) {
+		children[child] = GetChildLink(node, child);
+		if (children[child] != Link()) {
+			leaves = leaves && IsLeaf(ResolveNode(children[child]));
+			objects_below += ResolveNode(children[child])->objects.size;
+		}
+	}
+	if (!leaves || node->objects.size + objects_below > Policy::node_capacity) {
+		// objects which came while queries were running may still wait for the split
+		if (!node->objects.Empty()) {
+			split_path_.clear();
+			SplitNode(link, &split_path_);
+		}
+		return;
+	}
+	// the node is a leaf with room again, the descents of the objects stop there
+	for (int child = 0; child < 4; child++) {
+		GetChildLink(node, child) = Link();
+	}
+	split_path_.clear();
+	for (Link child_link : children) {
+		if (child_link == Link()) {
+			continue;
+		}
+		Bucket& child_objects = ResolveNode(child_link)->objects;
+		while (!child_objects.Empty()) {
+			Slot* slot = static_cast<Slot*>(child_objects.Slots()[child_objects.size - 1]);
+			Object* object = GetSlotObject(slot);
+			bounding_box<Number> object_bounds(0, 0, 0, 0);
+			BoundingBoxExtractor::ExtractBoundingBox(object, &object_bounds);
+			bounding_box<Number> fat_bounds = GetFatBounds(object_bounds);
+			Cell cell;
+			// its fat box is made anew and may lead elsewhere
+			Link node_for = GetNodeFor(fat_bounds, &cell, &split_path_);
+			static_cast<SlotCell&>(*slot) = cell;
+			static_cast<SlotFatBox&>(*slot) = FatBox(fat_bounds);
+			DetachSlot(slot);
+			AddToBucket(node_for, object, object_bounds, slot);
+			if (splitting_node_ != Link()) {
+				SplitNode(splitting_node_, &split_path_);
+			}
+		}
+		DeleteNode(child_link);
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+bool
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+IsQueryReading(const Node* node) const {
+	for (const typename query::Impl& query_impl : query_pool_) {
+		if (query_impl.IsReading(node)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+bool
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+IsLeaf(const Node* node) {
+	return node->top_left == Link() && node->top_right == Link() &&
+		node->bottom_right == Link() && node->bottom_left == Link();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+auto
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+GetChildLink(Node* node, int child) -> Link& {
+	switch (child) {
+	case 0:
+		return node->top_left;
+	case 1:
+		return node->top_right;
+	case 2:
+		return node->bottom_right;
+	default:
+		return node->bottom_left;
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+bounding_box<NumberT>
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+GetChildBounds(const bounding_box<Number>& node_bounds, int child) {
+	detail::ChildPosition child_position = detail::ChildPosition::kBottomLeft;
+	switch (child) {
+	case 0:
+		child_position = detail::ChildPosition::kTopLeft;
+		break;
+	case 1:
+		child_position = detail::ChildPosition::kTopRight;
+		break;
+	case 2:
+		child_position = detail::ChildPosition::kBottomRight;
+		break;
+	}
+	return BuildTraversal::GetChildBoundingBox(node_bounds, child_position);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+ExtractBuildEntries(Object* const* objects, BuildEntry* first, BuildEntry* last) const {
+	for (BuildEntry* entry = first; entry != last; entry++, objects++) {
+		entry->object = *objects;
+		BoundingBoxExtractor::ExtractBoundingBox(entry->object, &entry->object_bounds);
+		GetCenterAndExtent(GetFatBounds(entry->object_bounds),
+			&entry->center_x, &entry->center_y, &entry->extent);
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+SortBuildEntries(const bounding_box<Number>& node_bounds, int depth,
+		BuildEntry* first, BuildEntry* last,
+		std::vector<BuildRecord>* records, std::vector<BuildSubtree>* subtrees) const {
+	if (subtrees != nullptr && depth == kBuildSubtreeDepth) {
+		records->push_back(BuildRecord{kSortedApart, (std::uint32_t)subtrees->size()});
+		subtrees->push_back(BuildSubtree{node_bounds, depth, first, last, std::vector<BuildRecord>()});
+		return;
+	}
+	Number maximal_bb_extent =
+			node_bounds.width >= node_bounds.height ?
+				node_bounds.width : node_bounds.height;
+	Number children_extent = GetLooseReach(
+		(Number)((typename detail::MakeDistance<Number>::Type)maximal_bb_extent / 2));
+	Number node_center_x = (Number)(node_bounds.left +
+		(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.width / 2));
+	Number node_center_y = (Number)(node_bounds.top +
+		(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.height / 2));
+
+	// the objects the descent would stop here with first, then the ones of the four
+	// children in the order of the links, the way down sorts them by their Z order
+	bool leaf = depth >= maximal_depth_ || (Policy::node_capacity > 0 &&
+		depth >= Policy::minimal_depth && (std::size_t)(last - first) <= Policy::node_capacity);
+	BuildEntry* children_first = leaf ? last :
+		std::partition(first, last, [=](const BuildEntry& entry) {
+			return entry.extent > children_extent;
+		});
+	BuildEntry* bottom_first = std::partition(children_first, last, [=](const BuildEntry& entry) {
+		return entry.center_y < node_center_y;
+	});
+	BuildEntry* children[5] = {
+		children_first,
+		std::partition(children_first, bottom_first, [=](const BuildEntry& entry) {
+			return entry.center_x < node_center_x;
+		}),
+		bottom_first,
+		std::partition(bottom_first, last, [=](const BuildEntry& entry) {
+			return entry.center_x >= node_center_x;
+		}),
+		last};
+
+	BuildRecord record = {(std::uint32_t)(children_first - first), 0};
+	for (int child = 0; child < 4; child++) {
+		record.children |= children[child] != children[child + 1] ? 1u << child : 0u;
+	}
+	records->push_back(record);
+	for (int child = 0; child < 4; child++) {
+		if (children[child] != children[child + 1]) {
+			SortBuildEntries(GetChildBounds(node_bounds, child),
+				depth + 1, children[child], children[child + 1], records, subtrees);
+		}
+	}
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+auto
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
+BuildNode(const BuildRecord* record, const std::vector<BuildSubtree>& subtrees,
+		Link link, const bounding_box<Number>& node_bounds, int depth, const Cell& cell,
+		BuildEntry** next_entry) -> const BuildRecord* {
+	if (record->staying == kSortedApart) {
+		const BuildSubtree& subtree = subtrees[record->children];
+		assert(*next_entry == subtree.first);
+		BuildNode(subtree.records.data(), subtrees, link, node_bounds, depth, cell, next_entry);
+		assert(*next_entry == subtree.last);
+		return record + 1;
+	}
+	Number maximal_bb_extent =
+			node_bounds.width >= node_bounds.height ?
+				node_bounds.width : node_bounds.height;
+	Number children_extent = GetLooseReach(
+		(Number)((typename detail::MakeDistance<Number>::Type)maximal_bb_extent / 2));
+	Number node_center_x = (Number)(node_bounds.left +
+		(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.width / 2));
+	Number node_center_y = (Number)(node_bounds.top +
+		(Number)((typename detail::MakeDistance<Number>::Type)node_bounds.height / 2));
+
+	if (record->staying > 0) {
+		Bucket& objects = ResolveNode(link)->objects;
+		std::uint32_t size = record->staying;
+		GrowBucket(objects, size + size % 2);
+		Cell node_cell = cell;
+		// the way GetNodeFor stops at leaves with room
+		node_cell.minimal_extent = Policy::node_capacity > 0 && record->children == 0 &&
+			depth >= Policy::minimal_depth ? 0 : children_extent;
+		node_cell.depth = depth;
+		for (BuildEntry* entry = *next_entry; entry != *next_entry + size; entry++) {
+			assert(node_bounds.contains(entry->center_x, entry->center_y));
+			if (object_slots_.Find(entry->object) != nullptr) {
+				number_of_objects_--; // the same object twice
+				continue;
+			}
+			Slot* slot = NewSlot();
+			static_cast<SlotCell&>(*slot) = node_cell;
+			static_cast<SlotFatBox&>(*slot) = FatBox(GetFatBounds(entry->object_bounds));
+			AddToBucket(link, entry->object, entry->object_bounds, slot);
+			object_slots_.Insert(entry->object, slot);
+		}
+		*next_entry += size;
+	}
+
+	std::uint32_t children = record->children;
+	record++;
+	for (int child = 0; child < 4; child++) {
+		if ((children & (1u << child)) == 0) {
+			continue;
+		}
+		Link child_link = NewNode(); // pools never move nodes
+		Node* node = ResolveNode(link);
+		Cell child_cell = cell;
+		child_cell.maximal_extent = children_extent;
+		switch (child) {
+		case 0:
+			node->top_left = child_link;
+			child_cell.right = node_center_x;
+			child_cell.bottom = node_center_y;
+			break;
+		case 1:
+			node->top_right = child_link;
+			child_cell.left = node_center_x;
+			child_cell.bottom = node_center_y;
+			break;
+		case 2:
+			node->bottom_right = child_link;
+			child_cell.left = node_center_x;
+			child_cell.top = node_center_y;
+			break;
+		default:
+			node->bottom_left = child_link;
+			child_cell.right = node_center_x;
+			child_cell.top = node_center_y;
+			break;
+		}
+		record = BuildNode(record, subtrees, child_link,
+			GetChildBounds(node_bounds, child),
+			depth + 1, child_cell, next_entry);
 	}
+	return record;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 auto
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::impl::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::impl::
 GetAvailableQueryFromPool() -> typename query::Impl* {
 	for (auto it = query_pool_.begin(); it != query_pool_.end(); it++) {
 		if (it->IsAvailable()) {
@@ -1382,101 +4278,211 @@ GetAvailableQueryFromPool() -> typename query::Impl* {
 
 
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+quad_tree(memory_resource* resource) : impl_(resource) {
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 bool
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
 insert(Object* object) {
 	return impl_.Insert(object);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 bool
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
 update(Object* object) {
 	return impl_.Update(object);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 bool
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
 remove(Object* object) {
 	return impl_.Remove(object);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 bool
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
 contains(Object* object) const {
 	return impl_.Contains(object);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+auto
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+insert_with_handle(Object* object) -> handle {
+	return impl_.InsertWithHandle(object);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+update(handle object_handle) {
+	impl_.Update(object_handle);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+remove(handle object_handle) {
+	impl_.Remove(object_handle);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+std::size_t
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+insert_many(Object* const* objects, std::size_t count) {
+	return impl_.InsertMany(objects, count);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+std::size_t
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+update_many(Object* const* objects, std::size_t count) {
+	return count - impl_.InsertMany(objects, count);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+std::size_t
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+remove_many(Object* const* objects, std::size_t count) {
+	return impl_.RemoveMany(objects, count);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+build(Object* const* objects, std::size_t count) {
+	impl_.Build(objects, count);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+build(Object* const* objects, std::size_t count, const build_executor& executor) {
+	impl_.Build(objects, count, &executor);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 auto
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
 query_intersects_region(const bounding_box<Number>& region) -> query {
 	return impl_.QueryIntersectsRegion(region);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 auto
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
 query_inside_region(const bounding_box<Number>& region) -> query {
 	return impl_.QueryInsideRegion(region);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 auto
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
 query_contains_region(const bounding_box<Number>& region) -> query {
 	return impl_.QueryContainsRegion(region);
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 const bounding_box<NumberT>&
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
 get_loose_bounding_box() const {
 	return impl_.GetBoundingBox();
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 void
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
 force_cleanup() {
 	impl_.ForceCleanup();
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+bool
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+maintain(std::size_t budget_nodes) {
+	return impl_.Maintain(budget_nodes);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+memory_stats
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+get_memory_stats() const {
+	return impl_.GetMemoryStats();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 int
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
 get_size() const {
 	return impl_.GetSize();
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 bool
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
 is_empty() const {
 	return impl_.GetSize() == 0;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+reserve(std::size_t objects) {
+	impl_.Reserve(objects);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+reserve_bounds(const bounding_box<Number>& bounds) {
+	impl_.ReserveBounds(bounds);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+shrink_bounds() {
+	impl_.ShrinkBounds();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+void
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+set_fat_margin(Number margin) {
+	impl_.SetFatMargin(margin);
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+NumberT
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
+get_fat_margin() const {
+	return impl_.GetFatMargin();
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 void
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::
 clear() {
 	impl_.Clear();
 }
 
 
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::
 query(Impl* pimpl) : pimpl_(pimpl) {
 	assert(pimpl_ != nullptr);
 	assert(!pimpl_->IsAvailable());
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::
 ~query() {
 	if (pimpl_ != nullptr) {
 		pimpl_->Release();
@@ -1485,15 +4491,15 @@ template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
 	}
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::
 query(query&& other) noexcept : pimpl_(other.pimpl_) {
 	other.pimpl_ = nullptr;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 auto
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::
 operator=(query&& other) -> query& {
 	this->~query();
 	pimpl_ = other.pimpl_;
@@ -1501,30 +4507,57 @@ operator=(query&& other) -> query& {
 	return *this;
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 bool
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::
 end_of_query() const {
 	return pimpl_->end_of_query();
 }
 
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 ObjectT*
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::
 get_current() const {
 	return pimpl_->GetCurrent();
 }
 
-template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT>
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
 void
-	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT>::query::
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::query::
 next() {
 	pimpl_->Next();
 }
 
 
 
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::handle::
+handle(void* slot) : slot_(slot) {
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::handle::
+operator bool() const {
+	return slot_ != nullptr;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+bool
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::handle::
+operator==(const handle& other) const {
+	return slot_ == other.slot_;
+}
+
+template <typename NumberT, typename ObjectT, typename BoundingBoxExtractorT, typename PolicyT>
+bool
+	quad_tree<NumberT, ObjectT, BoundingBoxExtractorT, PolicyT>::handle::
+operator!=(const handle& other) const {
+	return slot_ != other.slot_;
+}
+
+
+
 } //loose_quadtree
 
 #endif //LOOSEQUADTREE_LOOSEQUADTREE_IMPL_H
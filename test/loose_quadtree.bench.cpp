@@ -0,0 +1,712 @@
+#include <chrono>
+#include <cstddef>
+#include <limits>
+#include <random>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/catch_template_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include "loose_quadtree/loose_quadtree.hpp"
+
+#define TYPES_FOR_BENCHMARKING \
+  float, double, int, long long
+
+template<class NumberT>
+class TrivialBBExtractor {
+public:
+  static void ExtractBoundingBox(const loose_quadtree::bounding_box<NumberT>* object,
+                                 loose_quadtree::bounding_box<NumberT>* bbox) {
+    bbox->left = object->left;
+    bbox->top = object->top;
+    bbox->width = object->width;
+    bbox->height = object->height;
+  }
+};
+
+// counts the boxes looked at, that is the objects tested by queries without cached boxes
+template<class NumberT>
+class CountingBBExtractor {
+public:
+  static void ExtractBoundingBox(const loose_quadtree::bounding_box<NumberT>* object,
+                                 loose_quadtree::bounding_box<NumberT>* bbox) {
+    TrivialBBExtractor<NumberT>::ExtractBoundingBox(object, bbox);
+    extractions++;
+  }
+
+  static std::size_t extractions;
+};
+
+template<class NumberT>
+std::size_t CountingBBExtractor<NumberT>::extractions = 0;
+
+struct CachedBoxesPolicy : loose_quadtree::default_policy {
+  static constexpr bool cache_bounding_boxes = true;
+};
+
+struct CompactNodesPolicy : loose_quadtree::default_policy {
+  static constexpr bool compact_nodes = true;
+};
+
+struct FlatObjectMapPolicy : loose_quadtree::default_policy {
+  static constexpr bool flat_object_map = true;
+};
+
+struct NodeCellsPolicy : loose_quadtree::default_policy {
+  static constexpr bool cache_node_cells = true;
+};
+
+struct FatBoxesPolicy : loose_quadtree::default_policy {
+  static constexpr bool fat_bounding_boxes = true;
+};
+
+template<class NumberT, class PolicyT = loose_quadtree::default_policy>
+using BenchQuadTree =
+  loose_quadtree::quad_tree<NumberT, loose_quadtree::bounding_box<NumberT>, TrivialBBExtractor<NumberT>, PolicyT>;
+
+// Random boxes spread over a good part of the number range, the same workload as the StressTest
+template<class NumberT>
+class StressWorkload {
+public:
+  explicit StressWorkload(std::size_t objects_generated) :
+    index_(0, objects_generated - 1),
+    coordinate_(std::is_integral<NumberT>::value ?
+                (float)(std::is_signed<NumberT>::value ?
+                        -std::numeric_limits<NumberT>::max() / 8 :
+                        std::numeric_limits<NumberT>::max() / 16 * 7) :
+                -1.0f,
+                std::is_integral<NumberT>::value ?
+                (float)(std::is_signed<NumberT>::value ?
+                        std::numeric_limits<NumberT>::max() / 8 :
+                        std::numeric_limits<NumberT>::max() / 16 * 9) :
+                1.0f),
+    distance_(0.0f, std::is_integral<NumberT>::value ?
+                    (float)(std::is_signed<NumberT>::value ?
+                            std::numeric_limits<NumberT>::max() / 8 :
+                            std::numeric_limits<NumberT>::max() / 16) :
+                    0.5f) {
+    objects.reserve(objects_generated);
+    for (std::size_t i = 0; i < objects_generated; i++) {
+      objects.push_back(random_box());
+    }
+  }
+
+  // small objects, the typical content of a game world
+  loose_quadtree::bounding_box<NumberT> random_box() {
+    return loose_quadtree::bounding_box<NumberT>((NumberT)coordinate_(rand_), (NumberT)coordinate_(rand_),
+                                                 (NumberT)(distance_(rand_) / 64), (NumberT)(distance_(rand_) / 64));
+  }
+
+  // query regions are bigger than most of the objects
+  loose_quadtree::bounding_box<NumberT> random_region() {
+    return loose_quadtree::bounding_box<NumberT>((NumberT)coordinate_(rand_), (NumberT)coordinate_(rand_),
+                                                 (NumberT)(distance_(rand_) / 4), (NumberT)(distance_(rand_) / 4));
+  }
+
+  std::size_t random_index() {
+    return index_(rand_);
+  }
+
+  // a move by a fraction of the size, the typical update of a game world
+  void jitter(loose_quadtree::bounding_box<NumberT>* box) {
+    NumberT step = (NumberT)(box->width / 8);
+    box->left = (NumberT)(index_(rand_) & 1 ? box->left + step : box->left - step);
+    box->top = (NumberT)(index_(rand_) & 1 ? box->top + step : box->top - step);
+  }
+
+  // a few jitter steps of the average object
+  NumberT fat_margin() const {
+    return (NumberT)(distance_.max() / 256);
+  }
+
+  std::vector<loose_quadtree::bounding_box<NumberT>> objects;
+
+private:
+  std::minstd_rand rand_;
+  std::uniform_int_distribution<std::size_t> index_;
+  std::uniform_real_distribution<float> coordinate_;
+  std::uniform_real_distribution<float> distance_;
+};
+
+
+TEMPLATE_TEST_CASE("StressBenchmark", "[!benchmark]", TYPES_FOR_BENCHMARKING) {
+  const std::size_t objects_generated = 200000;
+  const int object_fluctuation = 20000;
+  StressWorkload<TestType> workload(objects_generated);
+
+  BENCHMARK("insert 200k") {
+    BenchQuadTree<TestType> lqt;
+    for (auto& object : workload.objects) {
+      lqt.insert(&object);
+    }
+    return lqt.get_size();
+  };
+
+  std::vector<loose_quadtree::bounding_box<TestType>*> pointers;
+  for (auto& object : workload.objects) {
+    pointers.push_back(&object);
+  }
+
+  BENCHMARK("build 200k") {
+    BenchQuadTree<TestType> lqt;
+    lqt.build(pointers.data(), pointers.size());
+    return lqt.get_size();
+  };
+
+  // 1, 2, 4 ... threads up to all the cores
+  unsigned maximal_threads = std::thread::hardware_concurrency();
+  for (unsigned threads = 1; threads == 1 || threads <= maximal_threads;
+       threads = threads < maximal_threads && threads * 2 > maximal_threads ? maximal_threads : threads * 2) {
+    loose_quadtree::build_executor executor = loose_quadtree::thread_build_executor(threads);
+    BENCHMARK("build 200k, " + std::to_string(threads) + " threads") {
+      BenchQuadTree<TestType> lqt;
+      lqt.build(pointers.data(), pointers.size(), executor);
+      return lqt.get_size();
+    };
+  }
+
+  BenchQuadTree<TestType> lqt;
+  for (auto& object : workload.objects) {
+    lqt.insert(&object);
+  }
+
+  BENCHMARK("update 20k") {
+    for (int i = 0; i < object_fluctuation; i++) {
+      std::size_t id = workload.random_index();
+      workload.objects[id] = workload.random_box();
+      lqt.update(&workload.objects[id]);
+    }
+    return lqt.get_size();
+  };
+
+  BENCHMARK("update 20k, small moves") {
+    for (int i = 0; i < object_fluctuation; i++) {
+      std::size_t id = workload.random_index();
+      workload.jitter(&workload.objects[id]);
+      lqt.update(&workload.objects[id]);
+    }
+    return lqt.get_size();
+  };
+
+  std::vector<loose_quadtree::bounding_box<TestType>*> batch;
+
+  BENCHMARK("update 20k, batched") {
+    batch.clear();
+    for (int i = 0; i < object_fluctuation; i++) {
+      std::size_t id = workload.random_index();
+      workload.objects[id] = workload.random_box();
+      batch.push_back(&workload.objects[id]);
+    }
+    return lqt.update_many(batch.data(), batch.size());
+  };
+
+  BENCHMARK("update 20k, small moves, batched") {
+    batch.clear();
+    for (int i = 0; i < object_fluctuation; i++) {
+      std::size_t id = workload.random_index();
+      workload.jitter(&workload.objects[id]);
+      batch.push_back(&workload.objects[id]);
+    }
+    return lqt.update_many(batch.data(), batch.size());
+  };
+
+  BenchQuadTree<TestType, NodeCellsPolicy> cells_lqt;
+  for (auto& object : workload.objects) {
+    cells_lqt.insert(&object);
+  }
+
+  BENCHMARK("update 20k, small moves, node cells") {
+    for (int i = 0; i < object_fluctuation; i++) {
+      std::size_t id = workload.random_index();
+      workload.jitter(&workload.objects[id]);
+      cells_lqt.update(&workload.objects[id]);
+    }
+    return cells_lqt.get_size();
+  };
+
+  BENCHMARK("update 20k, node cells") {
+    for (int i = 0; i < object_fluctuation; i++) {
+      std::size_t id = workload.random_index();
+      workload.objects[id] = workload.random_box();
+      cells_lqt.update(&workload.objects[id]);
+    }
+    return cells_lqt.get_size();
+  };
+
+  BenchQuadTree<TestType, FatBoxesPolicy> fat_lqt;
+  fat_lqt.set_fat_margin(workload.fat_margin());
+  for (auto& object : workload.objects) {
+    fat_lqt.insert(&object);
+  }
+
+  BENCHMARK("update 20k, small moves, fat boxes") {
+    for (int i = 0; i < object_fluctuation; i++) {
+      std::size_t id = workload.random_index();
+      workload.jitter(&workload.objects[id]);
+      fat_lqt.update(&workload.objects[id]);
+    }
+    return fat_lqt.get_size();
+  };
+
+  std::vector<typename BenchQuadTree<TestType>::handle> handles;
+  for (auto& object : workload.objects) {
+    handles.push_back(lqt.insert_with_handle(&object));
+  }
+
+  BENCHMARK("update 20k, handles") {
+    for (int i = 0; i < object_fluctuation; i++) {
+      std::size_t id = workload.random_index();
+      workload.objects[id] = workload.random_box();
+      lqt.update(handles[id]);
+    }
+    return lqt.get_size();
+  };
+
+  BENCHMARK("remove and insert 20k") {
+    for (int i = 0; i < object_fluctuation; i++) {
+      std::size_t id = workload.random_index();
+      lqt.remove(&workload.objects[id]);
+      lqt.insert(&workload.objects[id]);
+    }
+    return lqt.get_size();
+  };
+
+  BENCHMARK("clear and insert 200k") {
+    lqt.clear();
+    for (auto& object : workload.objects) {
+      lqt.insert(&object);
+    }
+    return lqt.get_size();
+  };
+
+  BENCHMARK("query intersects") {
+    int count = 0;
+    auto query = lqt.query_intersects_region(workload.random_region());
+    while (!query.end_of_query()) {
+      count++;
+      query.next();
+    }
+    return count;
+  };
+
+  BenchQuadTree<TestType, CachedBoxesPolicy> cached_lqt;
+  for (auto& object : workload.objects) {
+    cached_lqt.insert(&object);
+  }
+
+  BENCHMARK("query intersects, cached boxes") {
+    int count = 0;
+    auto query = cached_lqt.query_intersects_region(workload.random_region());
+    while (!query.end_of_query()) {
+      count++;
+      query.next();
+    }
+    return count;
+  };
+
+  BENCHMARK("insert 200k, compact nodes") {
+    BenchQuadTree<TestType, CompactNodesPolicy> compact_lqt;
+    for (auto& object : workload.objects) {
+      compact_lqt.insert(&object);
+    }
+    return compact_lqt.get_size();
+  };
+
+  BenchQuadTree<TestType, CompactNodesPolicy> compact_lqt;
+  for (auto& object : workload.objects) {
+    compact_lqt.insert(&object);
+  }
+
+  BENCHMARK("query intersects, compact nodes") {
+    int count = 0;
+    auto query = compact_lqt.query_intersects_region(workload.random_region());
+    while (!query.end_of_query()) {
+      count++;
+      query.next();
+    }
+    return count;
+  };
+}
+
+
+// Churn on the lookup by object pointer, the objects stay in place so the tree does little else
+TEMPLATE_TEST_CASE("ObjectMapBenchmark", "[!benchmark]", TYPES_FOR_BENCHMARKING) {
+  const std::size_t objects_generated = 200000;
+  const int object_fluctuation = 20000;
+  StressWorkload<TestType> workload(objects_generated);
+
+  BENCHMARK("insert 200k, unordered_map") {
+    BenchQuadTree<TestType> lqt;
+    for (auto& object : workload.objects) {
+      lqt.insert(&object);
+    }
+    return lqt.get_size();
+  };
+
+  BENCHMARK("insert 200k, flat map") {
+    BenchQuadTree<TestType, FlatObjectMapPolicy> lqt;
+    for (auto& object : workload.objects) {
+      lqt.insert(&object);
+    }
+    return lqt.get_size();
+  };
+
+  BENCHMARK("insert 200k, flat map reserved") {
+    BenchQuadTree<TestType, FlatObjectMapPolicy> lqt;
+    lqt.reserve(workload.objects.size());
+    for (auto& object : workload.objects) {
+      lqt.insert(&object);
+    }
+    return lqt.get_size();
+  };
+
+  BenchQuadTree<TestType> lqt;
+  BenchQuadTree<TestType, FlatObjectMapPolicy> flat_lqt;
+  for (auto& object : workload.objects) {
+    lqt.insert(&object);
+    flat_lqt.insert(&object);
+  }
+
+  BENCHMARK("update in place 20k, unordered_map") {
+    for (int i = 0; i < object_fluctuation; i++) {
+      lqt.update(&workload.objects[workload.random_index()]);
+    }
+    return lqt.get_size();
+  };
+
+  BENCHMARK("update in place 20k, flat map") {
+    for (int i = 0; i < object_fluctuation; i++) {
+      flat_lqt.update(&workload.objects[workload.random_index()]);
+    }
+    return flat_lqt.get_size();
+  };
+
+  BENCHMARK("remove and insert 20k, unordered_map") {
+    for (int i = 0; i < object_fluctuation; i++) {
+      std::size_t id = workload.random_index();
+      lqt.remove(&workload.objects[id]);
+      lqt.insert(&workload.objects[id]);
+    }
+    return lqt.get_size();
+  };
+
+  BENCHMARK("remove and insert 20k, flat map") {
+    for (int i = 0; i < object_fluctuation; i++) {
+      std::size_t id = workload.random_index();
+      flat_lqt.remove(&workload.objects[id]);
+      flat_lqt.insert(&workload.objects[id]);
+    }
+    return flat_lqt.get_size();
+  };
+
+  BENCHMARK("contains 200k, unordered_map") {
+    int count = 0;
+    for (auto& object : workload.objects) {
+      count += lqt.contains(&object);
+    }
+    return count;
+  };
+
+  BENCHMARK("contains 200k, flat map") {
+    int count = 0;
+    for (auto& object : workload.objects) {
+      count += flat_lqt.contains(&object);
+    }
+    return count;
+  };
+}
+
+
+template<class QuadTreeT, class NumberT>
+int CountInside(QuadTreeT& lqt, const loose_quadtree::bounding_box<NumberT>& region) {
+  int count = 0;
+  auto query = lqt.query_inside_region(region);
+  while (!query.end_of_query()) {
+    count++;
+    query.next();
+  }
+  return count;
+}
+
+template<class QuadTreeT, class NumberT>
+double ObjectsTestedPerSecond(QuadTreeT& lqt, const loose_quadtree::bounding_box<NumberT>& region,
+                              std::size_t tested_per_query) {
+  using Clock = std::chrono::steady_clock;
+  std::size_t queries = 0;
+  int found = 0;
+  Clock::time_point start = Clock::now();
+  Clock::duration elapsed;
+  do {
+    found += CountInside(lqt, region);
+    queries++;
+    elapsed = Clock::now() - start;
+  } while (elapsed < std::chrono::milliseconds(250));
+  REQUIRE(found == 0);
+  return (double)(tested_per_query * queries) / std::chrono::duration<double>(elapsed).count();
+}
+
+// Boxes of the same size around the same spot crowd a few nodes, a small query region
+// in the middle has to test nearly all of them and finds none inside
+TEMPLATE_TEST_CASE("DenseLeafBenchmark", "[!benchmark]", TYPES_FOR_BENCHMARKING) {
+  const std::size_t objects_generated = 4096;
+  const double scale = std::is_integral<TestType>::value ?
+                       (double)(std::numeric_limits<TestType>::max() / 64) : 1.0;
+  std::minstd_rand rand;
+  std::uniform_real_distribution<double> offset(0.0, 0.25);
+  std::vector<loose_quadtree::bounding_box<TestType>> objects;
+  for (std::size_t i = 0; i < objects_generated; i++) {
+    objects.emplace_back((TestType)(offset(rand) * scale), (TestType)(offset(rand) * scale),
+                         (TestType)(0.5 * scale), (TestType)(0.5 * scale));
+  }
+  loose_quadtree::bounding_box<TestType> region((TestType)(0.37 * scale), (TestType)(0.37 * scale),
+                                                (TestType)(0.01 * scale), (TestType)(0.01 * scale));
+
+  loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, CountingBBExtractor<TestType>> lqt;
+  BenchQuadTree<TestType, CachedBoxesPolicy> cached_lqt;
+  for (auto& object : objects) {
+    lqt.insert(&object);
+    cached_lqt.insert(&object);
+  }
+  CountingBBExtractor<TestType>::extractions = 0;
+  CountInside(lqt, region);
+  const std::size_t tested_per_query = CountingBBExtractor<TestType>::extractions;
+  REQUIRE(tested_per_query > objects_generated / 2);
+
+  BENCHMARK("inside, extracted boxes") {
+    return CountInside(lqt, region);
+  };
+
+  BENCHMARK("inside, cached boxes") {
+    return CountInside(cached_lqt, region);
+  };
+
+  WARN("objects tested per second with extracted boxes: " <<
+       ObjectsTestedPerSecond(lqt, region, tested_per_query));
+  WARN("objects tested per second with cached boxes: " <<
+       ObjectsTestedPerSecond(cached_lqt, region, tested_per_query));
+}
+
+struct NodeCapacityPolicy : loose_quadtree::default_policy {
+  static constexpr std::size_t node_capacity = 16;
+};
+
+// Nine of ten boxes in a few small spots (the cities) and the rest spread out (the ocean),
+// the queries look at both halves of the time
+template<class NumberT>
+class ClusteredWorkload {
+public:
+  explicit ClusteredWorkload(StressWorkload<NumberT>& workload) : objects(workload.objects) {
+    std::minstd_rand rand;
+    std::uniform_real_distribution<double> offset(0.0, 1.0);
+    const double spot_size = (double)workload.fat_margin() * 64;
+    for (int i = 0; i < 8; i++) {
+      spots_.push_back(workload.random_box());
+    }
+    for (std::size_t i = 0; i < objects.size(); i++) {
+      if (i % 10 != 0) {
+        const loose_quadtree::bounding_box<NumberT>& spot = spots_[i % spots_.size()];
+        objects[i].left = (NumberT)(spot.left + offset(rand) * spot_size);
+        objects[i].top = (NumberT)(spot.top + offset(rand) * spot_size);
+      }
+    }
+    for (std::size_t i = 0; i < 256; i++) {
+      if (i % 2 == 0) {
+        regions_.push_back(workload.random_region());
+      }
+      else {
+        const loose_quadtree::bounding_box<NumberT>& spot = spots_[i / 2 % spots_.size()];
+        regions_.emplace_back((NumberT)(spot.left + offset(rand) * spot_size),
+                              (NumberT)(spot.top + offset(rand) * spot_size),
+                              (NumberT)(spot_size / 16), (NumberT)(spot_size / 16));
+      }
+    }
+  }
+
+  const loose_quadtree::bounding_box<NumberT>& next_region() {
+    next_region_ = (next_region_ + 1) % regions_.size();
+    return regions_[next_region_];
+  }
+
+  std::vector<loose_quadtree::bounding_box<NumberT>> objects;
+
+private:
+  std::vector<loose_quadtree::bounding_box<NumberT>> spots_;
+  std::vector<loose_quadtree::bounding_box<NumberT>> regions_;
+  std::size_t next_region_ = 0;
+};
+
+template<class QuadTreeT, class NumberT>
+int CountIntersecting(QuadTreeT& lqt, const loose_quadtree::bounding_box<NumberT>& region) {
+  int count = 0;
+  auto query = lqt.query_intersects_region(region);
+  while (!query.end_of_query()) {
+    count++;
+    query.next();
+  }
+  return count;
+}
+
+// The depth of the whole tree following the number of objects against nodes splitting on their own,
+// on the workload of the StressBenchmark and on the same boxes crowded into a few spots
+TEMPLATE_TEST_CASE("NodeCapacityBenchmark", "[!benchmark]", TYPES_FOR_BENCHMARKING) {
+  const std::size_t objects_generated = 200000;
+  StressWorkload<TestType> workload(objects_generated);
+  ClusteredWorkload<TestType> clustered(workload);
+  using QuadTree = loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>,
+    CountingBBExtractor<TestType>>;
+  using CapacityQuadTree = loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>,
+    CountingBBExtractor<TestType>, NodeCapacityPolicy>;
+  QuadTree uniform_lqt;
+  QuadTree clustered_lqt;
+  CapacityQuadTree uniform_capacity_lqt;
+  CapacityQuadTree clustered_capacity_lqt;
+
+  BENCHMARK("insert 200k, uniform") {
+    uniform_lqt.clear();
+    for (auto& object : workload.objects) {
+      uniform_lqt.insert(&object);
+    }
+    return uniform_lqt.get_size();
+  };
+
+  BENCHMARK("insert 200k, uniform, node capacity") {
+    uniform_capacity_lqt.clear();
+    for (auto& object : workload.objects) {
+      uniform_capacity_lqt.insert(&object);
+    }
+    return uniform_capacity_lqt.get_size();
+  };
+
+  BENCHMARK("insert 200k, clustered") {
+    clustered_lqt.clear();
+    for (auto& object : clustered.objects) {
+      clustered_lqt.insert(&object);
+    }
+    return clustered_lqt.get_size();
+  };
+
+  BENCHMARK("insert 200k, clustered, node capacity") {
+    clustered_capacity_lqt.clear();
+    for (auto& object : clustered.objects) {
+      clustered_capacity_lqt.insert(&object);
+    }
+    return clustered_capacity_lqt.get_size();
+  };
+
+  BENCHMARK("query intersects, uniform") {
+    return CountIntersecting(uniform_lqt, workload.random_region());
+  };
+
+  BENCHMARK("query intersects, uniform, node capacity") {
+    return CountIntersecting(uniform_capacity_lqt, workload.random_region());
+  };
+
+  BENCHMARK("query intersects, clustered") {
+    return CountIntersecting(clustered_lqt, clustered.next_region());
+  };
+
+  BENCHMARK("query intersects, clustered, node capacity") {
+    return CountIntersecting(clustered_capacity_lqt, clustered.next_region());
+  };
+
+  // the same regions for both trees, the boxes they look at tell how well the nodes fit
+  std::size_t tested = 0;
+  std::size_t capacity_tested = 0;
+  for (int i = 0; i < 256; i++) {
+    const loose_quadtree::bounding_box<TestType>& region = clustered.next_region();
+    CountingBBExtractor<TestType>::extractions = 0;
+    int found = CountIntersecting(clustered_lqt, region);
+    tested += CountingBBExtractor<TestType>::extractions;
+    CountingBBExtractor<TestType>::extractions = 0;
+    REQUIRE(CountIntersecting(clustered_capacity_lqt, region) == found);
+    capacity_tested += CountingBBExtractor<TestType>::extractions;
+  }
+  WARN("clustered, boxes tested per query: " << tested / 256 << ", with node capacity: " << capacity_tested / 256 <<
+       ", nodes: " << clustered_lqt.get_memory_stats().nodes <<
+       ", with node capacity: " << clustered_capacity_lqt.get_memory_stats().nodes);
+}
+
+struct LoosenessThreeHalvesPolicy : loose_quadtree::default_policy {
+  using looseness = std::ratio<3, 2>;
+};
+
+struct LoosenessFiveQuartersPolicy : loose_quadtree::default_policy {
+  using looseness = std::ratio<5, 4>;
+};
+
+// Tighter loose bounds against objects sitting higher up, on the workload of the StressBenchmark
+TEMPLATE_TEST_CASE("LoosenessBenchmark", "[!benchmark]", TYPES_FOR_BENCHMARKING) {
+  const std::size_t objects_generated = 200000;
+  StressWorkload<TestType> workload(objects_generated);
+  std::vector<loose_quadtree::bounding_box<TestType>> regions;
+  for (int i = 0; i < 256; i++) {
+    regions.push_back(workload.random_region());
+  }
+  using QuadTree = loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>,
+    CountingBBExtractor<TestType>>;
+  using ThreeHalvesQuadTree = loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>,
+    CountingBBExtractor<TestType>, LoosenessThreeHalvesPolicy>;
+  using FiveQuartersQuadTree = loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>,
+    CountingBBExtractor<TestType>, LoosenessFiveQuartersPolicy>;
+  QuadTree lqt;
+  ThreeHalvesQuadTree three_halves_lqt;
+  FiveQuartersQuadTree five_quarters_lqt;
+
+  BENCHMARK("insert 200k, looseness 2") {
+    lqt.clear();
+    for (auto& object : workload.objects) {
+      lqt.insert(&object);
+    }
+    return lqt.get_size();
+  };
+
+  BENCHMARK("insert 200k, looseness 3/2") {
+    three_halves_lqt.clear();
+    for (auto& object : workload.objects) {
+      three_halves_lqt.insert(&object);
+    }
+    return three_halves_lqt.get_size();
+  };
+
+  BENCHMARK("insert 200k, looseness 5/4") {
+    five_quarters_lqt.clear();
+    for (auto& object : workload.objects) {
+      five_quarters_lqt.insert(&object);
+    }
+    return five_quarters_lqt.get_size();
+  };
+
+  std::size_t next_region = 0;
+  BENCHMARK("query intersects, looseness 2") {
+    next_region = (next_region + 1) % regions.size();
+    return CountIntersecting(lqt, regions[next_region]);
+  };
+
+  BENCHMARK("query intersects, looseness 3/2") {
+    next_region = (next_region + 1) % regions.size();
+    return CountIntersecting(three_halves_lqt, regions[next_region]);
+  };
+
+  BENCHMARK("query intersects, looseness 5/4") {
+    next_region = (next_region + 1) % regions.size();
+    return CountIntersecting(five_quarters_lqt, regions[next_region]);
+  };
+
+  // the boxes tested per query tell how many nodes the loose bounds let in
+  std::size_t tested[3] = {0, 0, 0};
+  for (const auto& region : regions) {
+    CountingBBExtractor<TestType>::extractions = 0;
+    int found = CountIntersecting(lqt, region);
+    tested[0] += CountingBBExtractor<TestType>::extractions;
+    CountingBBExtractor<TestType>::extractions = 0;
+    REQUIRE(CountIntersecting(three_halves_lqt, region) == found);
+    tested[1] += CountingBBExtractor<TestType>::extractions;
+    CountingBBExtractor<TestType>::extractions = 0;
+    REQUIRE(CountIntersecting(five_quarters_lqt, region) == found);
+    tested[2] += CountingBBExtractor<TestType>::extractions;
+  }
+  WARN("boxes tested per query with looseness 2: " << tested[0] / regions.size() <<
+       ", 3/2: " << tested[1] / regions.size() << ", 5/4: " << tested[2] / regions.size());
+}
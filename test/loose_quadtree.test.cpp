@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cstdint>
+#include <functional>
 #include <vector>
 #include <random>
 #include <catch2/catch_test_macros.hpp>
@@ -22,6 +25,40 @@ public:
   }
 };
 
+class CountingResource : public loose_quadtree::memory_resource {
+public:
+  std::size_t allocated_bytes = 0;
+  int allocations = 0;
+
+private:
+  void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+    allocated_bytes += bytes;
+    allocations++;
+    return loose_quadtree::new_delete_resource()->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+    allocated_bytes -= bytes;
+    allocations--;
+    loose_quadtree::new_delete_resource()->deallocate(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const loose_quadtree::memory_resource& other) const noexcept override {
+    return this == &other;
+  }
+};
+
+template<class QuadTreeT, class NumberT>
+int CountIntersecting(QuadTreeT& lqt, const loose_quadtree::bounding_box<NumberT>& region) {
+  int count = 0;
+  auto query = lqt.query_intersects_region(region);
+  while (!query.end_of_query()) {
+    count++;
+    query.next();
+  }
+  return count;
+}
+
 
 TEMPLATE_TEST_CASE("TestBoundingBox", "", TYPES_FOR_TESTING) {
   loose_quadtree::bounding_box<TestType> big(100, 100, 200, 50);
@@ -65,14 +102,112 @@ TEMPLATE_TEST_CASE("TestBoundingBox", "", TYPES_FOR_TESTING) {
   REQUIRE_FALSE(outside.intersects(big));
 }
 
+TEST_CASE("TestBlocksAllocator") {
+  using loose_quadtree::detail::BlocksAllocator;
+  const std::size_t object_size = GENERATE(as<std::size_t>(), 1, sizeof(void*), 3 * sizeof(void*),
+                                           std::size_t(BlocksAllocator::kMaxAllowedAlloc));
+  const std::size_t slots = BlocksAllocator::kBlockSize / object_size * 3 + 7;
+  BlocksAllocator allocator;
+  std::vector<char*> pointers;
+  for (std::size_t i = 0; i < slots; i++) {
+    pointers.push_back(reinterpret_cast<char*>(allocator.Allocate(object_size)));
+    std::fill(pointers.back(), pointers.back() + object_size, (char)i);
+  }
+  for (std::size_t i = 0; i < slots; i++) {
+    REQUIRE(pointers[i][object_size - 1] == (char)i);
+  }
+
+  // free every other slot, nothing can be given back
+  for (std::size_t i = 0; i < slots; i += 2) {
+    allocator.Deallocate(pointers[i], object_size);
+  }
+  allocator.ReleaseFreeBlocks();
+  for (std::size_t i = 1; i < slots; i += 2) {
+    REQUIRE(pointers[i][0] == (char)i);
+  }
+  for (std::size_t i = 0; i < slots; i += 2) {
+    pointers[i] = reinterpret_cast<char*>(allocator.Allocate(object_size));
+    std::fill(pointers[i], pointers[i] + object_size, (char)i);
+  }
+
+  // free the first half, the blocks holding only those are released
+  for (std::size_t i = 0; i < slots / 2; i++) {
+    allocator.Deallocate(pointers[i], object_size);
+  }
+  allocator.ReleaseFreeBlocks();
+  for (std::size_t i = slots / 2; i < slots; i++) {
+    REQUIRE(pointers[i][0] == (char)i);
+  }
+  for (std::size_t i = 0; i < slots / 2; i++) {
+    pointers[i] = reinterpret_cast<char*>(allocator.Allocate(object_size));
+  }
+  for (std::size_t i = 0; i < slots; i++) {
+    allocator.Deallocate(pointers[i], object_size);
+  }
+  allocator.ReleaseFreeBlocks();
+
+  // reset forgets everything at once, the blocks are reused afterwards
+  for (std::size_t i = 0; i < slots; i++) {
+    pointers[i] = reinterpret_cast<char*>(allocator.Allocate(object_size));
+  }
+  std::size_t blocks = allocator.GetStats().size_classes.at(0).blocks;
+  allocator.Reset();
+  REQUIRE(allocator.GetStats().size_classes.at(0).live_slots == 0);
+  for (std::size_t i = 0; i < slots; i++) {
+    pointers[i] = reinterpret_cast<char*>(allocator.Allocate(object_size));
+    std::fill(pointers[i], pointers[i] + object_size, (char)i);
+  }
+  for (std::size_t i = 0; i < slots; i++) {
+    REQUIRE(pointers[i][0] == (char)i);
+  }
+  REQUIRE(allocator.GetStats().size_classes.at(0).blocks == blocks);
+  allocator.Reset();
+  allocator.ReleaseFreeBlocks();
+  REQUIRE(allocator.GetStats().size_classes.empty());
+}
+
+TEMPLATE_TEST_CASE("TestBoxKernels", "", TYPES_FOR_TESTING) {
+  using loose_quadtree::detail::BoxTest;
+  using Kernel = typename loose_quadtree::detail::BoxKernel<TestType>::Type;
+  const BoxTest test = GENERATE(BoxTest::kIntersects, BoxTest::kInside, BoxTest::kContains);
+  // small coordinates so that touching and equal edges are frequent
+  std::minstd_rand rand;
+  std::uniform_int_distribution<int> coordinate(0, 12);
+  std::uniform_int_distribution<int> extent(0, 6);
+  std::vector<TestType> lefts, tops, widths, heights;
+  for (std::uint32_t i = 0; i < 3 * loose_quadtree::detail::kBoxTestBatch; i++) {
+    lefts.push_back((TestType)coordinate(rand));
+    tops.push_back((TestType)coordinate(rand));
+    widths.push_back((TestType)extent(rand));
+    heights.push_back((TestType)extent(rand));
+  }
+  for (int round = 0; round < 50; round++) {
+    loose_quadtree::bounding_box<TestType> region((TestType)coordinate(rand), (TestType)coordinate(rand),
+                                                  (TestType)extent(rand), (TestType)extent(rand));
+    std::uint32_t begin = (std::uint32_t)(round % 5);
+    std::uint32_t count = (std::uint32_t)(round * 7 % 33);
+    std::uint32_t mask = Kernel::Test(test, &lefts[begin], &tops[begin], &widths[begin], &heights[begin],
+                                      count, region);
+    for (std::uint32_t i = 0; i < 32; i++) {
+      bool hit = false;
+      if (i < count) {
+        loose_quadtree::bounding_box<TestType> box(lefts[begin + i], tops[begin + i],
+                                                   widths[begin + i], heights[begin + i]);
+        hit = test == BoxTest::kIntersects ? region.intersects(box) :
+              test == BoxTest::kInside ? region.contains(box) : box.contains(region);
+      }
+      REQUIRE(((mask >> i) & 1) == (std::uint32_t)hit);
+    }
+  }
+}
+
 TEMPLATE_TEST_CASE("TestForwardTreeTraversal", "", TYPES_FOR_TESTING) {
-  loose_quadtree::detail::BlocksAllocator allocator;
   loose_quadtree::detail::ForwardTreeTraversal<TestType, loose_quadtree::bounding_box<TestType>> fortt;
-  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> root(allocator);
-  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> tl(allocator);
-  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> tr(allocator);
-  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> br(allocator);
-  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> bl(allocator);
+  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> root;
+  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> tl;
+  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> tr;
+  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> br;
+  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> bl;
   root.top_left = &tl;
   tl.top_right = &tr;
   tr.bottom_right = &br;
@@ -122,13 +257,12 @@ TEMPLATE_TEST_CASE("TestForwardTreeTraversal", "", TYPES_FOR_TESTING) {
 }
 
 TEMPLATE_TEST_CASE("TestFullTreeTraversal", "", TYPES_FOR_TESTING) {
-  loose_quadtree::detail::BlocksAllocator allocator;
   loose_quadtree::detail::FullTreeTraversal<TestType, loose_quadtree::bounding_box<TestType>> fultt;
-  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> root(allocator);
-  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> tl(allocator);
-  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> tr(allocator);
-  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> br(allocator);
-  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> bl(allocator);
+  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> root;
+  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> tl;
+  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> tr;
+  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> br;
+  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> bl;
   root.top_left = &tl;
   tl.top_right = &tr;
   tr.bottom_right = &br;
@@ -172,12 +306,11 @@ TEMPLATE_TEST_CASE("TestFullTreeTraversal", "", TYPES_FOR_TESTING) {
 }
 
 TEMPLATE_TEST_CASE("TestBoundingBoxDiscrepancy", "", TYPES_FOR_TESTING) {
-  loose_quadtree::detail::BlocksAllocator allocator;
   loose_quadtree::detail::FullTreeTraversal<TestType, loose_quadtree::bounding_box<TestType>> ftt;
-  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> root(allocator);
-  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> tl(allocator);
-  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> tr(allocator);
-  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> br(allocator);
+  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> root;
+  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> tl;
+  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> tr;
+  loose_quadtree::detail::TreeNode<loose_quadtree::bounding_box<TestType>> br;
   root.top_left = &tl;
   root.top_right = &tr;
   root.bottom_right = &br;
@@ -394,6 +527,182 @@ TEMPLATE_TEST_CASE("TestUpdate", "", TYPES_FOR_TESTING) {
   }
 }
 
+TEMPLATE_TEST_CASE("TestHandles", "", TYPES_FOR_TESTING) {
+  using QuadTree =
+    loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>>;
+  std::vector<loose_quadtree::bounding_box<TestType>> objects;
+  objects.push_back({1000, 1000, 50, 30});
+  objects.push_back({1060, 1000, 50, 30});
+  objects.push_back({1060, 1000, 5, 3});
+  QuadTree lqt;
+
+  REQUIRE_FALSE(typename QuadTree::handle());
+  std::vector<typename QuadTree::handle> handles;
+  for (auto& obj: objects) {
+    handles.push_back(lqt.insert_with_handle(&obj));
+    REQUIRE(handles.back());
+  }
+  REQUIRE(lqt.get_size() == 3);
+  // inserting again updates and hands out the same handle
+  REQUIRE(lqt.insert_with_handle(&objects[1]) == handles[1]);
+  REQUIRE(lqt.get_size() == 3);
+  REQUIRE_FALSE(lqt.insert(&objects[2]));
+
+  // handles survive the objects moving to other nodes
+  objects[2].width = 100;
+  objects[2].height = 60;
+  lqt.update(handles[2]);
+  objects[0].left = 1500;
+  lqt.update(handles[0]);
+  REQUIRE(lqt.get_size() == 3);
+  REQUIRE(lqt.get_loose_bounding_box().intersects(objects[0]));
+  REQUIRE(CountIntersecting(lqt, loose_quadtree::bounding_box<TestType>(1490, 990, 20, 20)) == 1);
+  REQUIRE(CountIntersecting(lqt, loose_quadtree::bounding_box<TestType>(1140, 1045, 10, 10)) == 1);
+
+  {
+    auto query = lqt.query_intersects_region(lqt.get_loose_bounding_box());
+    lqt.remove(handles[2]);
+  }
+  REQUIRE(lqt.get_size() == 2);
+  REQUIRE_FALSE(lqt.contains(&objects[2]));
+  lqt.remove(handles[0]);
+  REQUIRE_FALSE(lqt.contains(&objects[0]));
+  REQUIRE(lqt.contains(&objects[1]));
+  lqt.update(handles[1]);
+  REQUIRE(lqt.remove(&objects[1]));
+  REQUIRE(lqt.is_empty());
+}
+
+template<class NumberT>
+struct HookedBox {
+  loose_quadtree::bounding_box<NumberT> box;
+  loose_quadtree::object_hook hook;
+};
+
+template<class NumberT>
+class HookedBoxExtractor {
+public:
+  static void ExtractBoundingBox(const HookedBox<NumberT>* object, loose_quadtree::bounding_box<NumberT>* bbox) {
+    *bbox = object->box;
+  }
+
+  static loose_quadtree::object_hook* ExtractObjectHook(HookedBox<NumberT>* object) {
+    return &object->hook;
+  }
+};
+
+template<class NumberT>
+struct ObjectHooksPolicy : loose_quadtree::default_policy {
+  using object_hook_extractor = HookedBoxExtractor<NumberT>;
+};
+
+TEMPLATE_TEST_CASE("TestObjectHooks", "", TYPES_FOR_TESTING) {
+  std::vector<HookedBox<TestType>> objects;
+  objects.push_back({{1000, 1000, 50, 30}, {}});
+  objects.push_back({{1060, 1000, 50, 30}, {}});
+  objects.push_back({{1060, 1000, 5, 3}, {}});
+  loose_quadtree::quad_tree<TestType, HookedBox<TestType>, HookedBoxExtractor<TestType>,
+    ObjectHooksPolicy<TestType>> lqt;
+
+  for (auto& obj: objects) {
+    REQUIRE(lqt.insert(&obj));
+    REQUIRE(obj.hook.slot != nullptr);
+  }
+  REQUIRE_FALSE(lqt.insert(&objects[0]));
+  REQUIRE(lqt.get_size() == 3);
+  REQUIRE(lqt.contains(&objects[2]));
+  HookedBox<TestType> copy = objects[2];
+  REQUIRE(copy.hook.slot == nullptr);
+  REQUIRE_FALSE(lqt.contains(&copy));
+  REQUIRE(lqt.get_memory_stats().object_pointer_bytes == 0);
+
+  objects[0].box.left = 1500;
+  REQUIRE(lqt.update(&objects[0]));
+  REQUIRE(CountIntersecting(lqt, loose_quadtree::bounding_box<TestType>(1490, 990, 20, 20)) == 1);
+  REQUIRE(CountIntersecting(lqt, loose_quadtree::bounding_box<TestType>(1000, 1000, 40, 40)) == 0);
+  {
+    auto query = lqt.query_intersects_region(lqt.get_loose_bounding_box());
+    REQUIRE(lqt.remove(&objects[1]));
+  }
+  REQUIRE(objects[1].hook.slot == nullptr);
+  REQUIRE_FALSE(lqt.contains(&objects[1]));
+  REQUIRE_FALSE(lqt.remove(&objects[1]));
+  REQUIRE(lqt.get_size() == 2);
+
+  // clear empties the hooks as well
+  lqt.clear();
+  for (auto& obj: objects) {
+    REQUIRE(obj.hook.slot == nullptr);
+  }
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+  }
+  REQUIRE(lqt.get_size() == 3);
+  lqt.clear();
+
+  // so does destroying a tree
+  CountingResource counting;
+  {
+    loose_quadtree::quad_tree<TestType, HookedBox<TestType>, HookedBoxExtractor<TestType>,
+      ObjectHooksPolicy<TestType>> lqt2(&counting);
+    for (auto& obj: objects) {
+      lqt2.insert(&obj);
+    }
+  }
+  for (auto& obj: objects) {
+    REQUIRE(obj.hook.slot == nullptr);
+  }
+  REQUIRE(counting.allocations == 0);
+}
+
+struct FlatObjectMapPolicy : loose_quadtree::default_policy {
+  static constexpr bool flat_object_map = true;
+};
+
+TEMPLATE_TEST_CASE("TestFlatObjectMap", "", TYPES_FOR_TESTING) {
+  std::vector<loose_quadtree::bounding_box<TestType>> objects;
+  for (int i = 0; i < 1000; i++) {
+    objects.push_back({(TestType)(1000 + i % 50 * 7), (TestType)(1000 + i / 50 * 9), 5, 5});
+  }
+  loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>,
+    FlatObjectMapPolicy> lqt;
+  REQUIRE_FALSE(lqt.contains(&objects[0]));
+  REQUIRE_FALSE(lqt.remove(&objects[0]));
+
+  lqt.reserve(objects.size());
+  std::size_t reserved_buckets = lqt.get_memory_stats().object_pointer_buckets;
+  REQUIRE(reserved_buckets >= objects.size());
+  for (auto& obj: objects) {
+    REQUIRE(lqt.insert(&obj));
+  }
+  REQUIRE(lqt.get_memory_stats().object_pointer_buckets == reserved_buckets);
+  REQUIRE_FALSE(lqt.insert(&objects[10]));
+  REQUIRE(lqt.get_size() == 1000);
+
+  // removals in scattered order shift the probe sequences back
+  std::minstd_rand rand;
+  std::vector<std::size_t> order(objects.size());
+  for (std::size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::shuffle(order.begin(), order.end(), rand);
+  for (std::size_t i = 0; i < order.size() / 2; i++) {
+    REQUIRE(lqt.remove(&objects[order[i]]));
+  }
+  for (std::size_t i = 0; i < order.size(); i++) {
+    REQUIRE(lqt.contains(&objects[order[i]]) == (i >= order.size() / 2));
+  }
+  for (std::size_t i = 0; i < order.size() / 2; i++) {
+    REQUIRE(lqt.insert(&objects[order[i]]));
+  }
+  REQUIRE(lqt.get_size() == 1000);
+  REQUIRE(CountIntersecting(lqt, lqt.get_loose_bounding_box()) == 1000);
+
+  lqt.clear();
+  REQUIRE_FALSE(lqt.contains(&objects[0]));
+  REQUIRE(lqt.insert(&objects[0]));
+}
+
 TEMPLATE_TEST_CASE("TestMoreTrees", "", TYPES_FOR_TESTING) {
   const bool reclaim_losses = GENERATE(true, false);
 
@@ -510,6 +819,1087 @@ TEMPLATE_TEST_CASE("TestMoreTrees", "", TYPES_FOR_TESTING) {
   }
 }
 
+TEMPLATE_TEST_CASE("TestMemoryResource", "", TYPES_FOR_TESTING) {
+  std::vector<loose_quadtree::bounding_box<TestType>> objects;
+  objects.push_back({1000, 1000, 50, 30});
+  objects.push_back({1060, 1000, 50, 30});
+  objects.push_back({1060, 1000, 5, 3});
+  CountingResource counting;
+  {
+    loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>>
+      lqt(&counting);
+    int allocations_when_empty = counting.allocations;
+    for (auto& obj: objects) {
+      lqt.insert(&obj);
+    }
+    REQUIRE(counting.allocations > allocations_when_empty);
+    REQUIRE(lqt.get_size() == 3);
+    lqt.clear();
+    lqt.force_cleanup();
+    REQUIRE(counting.allocations == allocations_when_empty);
+    lqt.insert(&objects[0]);
+    REQUIRE(lqt.contains(&objects[0]));
+  }
+  REQUIRE(counting.allocations == 0);
+  REQUIRE(counting.allocated_bytes == 0);
+
+  {
+    loose_quadtree::blocks_memory_resource shared(&counting);
+    loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>>
+      lqt1(&shared);
+    loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>>
+      lqt2(&shared);
+    REQUIRE(shared.upstream_resource() == &counting);
+    for (auto& obj: objects) {
+      lqt1.insert(&obj);
+      lqt2.insert(&obj);
+    }
+    lqt1.remove(&objects[1]);
+    lqt1.force_cleanup();
+    shared.release_free_blocks();
+    REQUIRE(lqt1.get_size() == 2);
+    REQUIRE(lqt2.get_size() == 3);
+    int count = 0;
+    auto query = lqt2.query_intersects_region(loose_quadtree::bounding_box<TestType>(900, 900, 300, 300));
+    while (!query.end_of_query()) {
+      count++;
+      query.next();
+    }
+    REQUIRE(count == 3);
+  }
+  REQUIRE(counting.allocations == 0);
+  REQUIRE(counting.allocated_bytes == 0);
+
+  {
+    loose_quadtree::blocks_memory_resource pool(&counting);
+    REQUIRE(pool.allocate(16) != nullptr);
+    REQUIRE(pool.allocate(4096) != nullptr);
+    REQUIRE(counting.allocations == 1);
+    REQUIRE(pool.get_stats().upstream_allocations == 1);
+    REQUIRE(pool.get_stats().upstream_bytes == 4096);
+    // reset frees the big allocations as well
+    pool.reset();
+    REQUIRE(counting.allocations == 0);
+    REQUIRE(pool.get_stats().upstream_allocations == 0);
+    REQUIRE(pool.allocate(4096) != nullptr);
+  }
+  REQUIRE(counting.allocations == 0);
+  REQUIRE(counting.allocated_bytes == 0);
+}
+
+TEMPLATE_TEST_CASE("TestMemoryStats", "", TYPES_FOR_TESTING) {
+  std::vector<loose_quadtree::bounding_box<TestType>> objects;
+  objects.push_back({1000, 1000, 50, 30});
+  objects.push_back({1060, 1000, 50, 30});
+  objects.push_back({1060, 1000, 5, 3});
+  loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>> lqt;
+
+  loose_quadtree::memory_stats stats = lqt.get_memory_stats();
+  REQUIRE(stats.nodes == 0);
+  REQUIRE(stats.object_slots == 0);
+  REQUIRE(stats.query_pool_size == 0);
+
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+  }
+  stats = lqt.get_memory_stats();
+  REQUIRE(stats.nodes > 0);
+  REQUIRE(stats.node_bytes > 0);
+  REQUIRE(stats.object_slots == 3);
+  REQUIRE(stats.tombstones == 0);
+  REQUIRE(stats.object_pointer_bytes > 0);
+  std::size_t live_slots = 0;
+  for (auto& size_class : stats.own_pool.size_classes) {
+    REQUIRE(size_class.blocks > 0);
+    REQUIRE(size_class.live_slots + size_class.free_slots ==
+            size_class.blocks * (stats.own_pool.block_size / size_class.slot_size));
+    live_slots += size_class.live_slots;
+  }
+  REQUIRE(live_slots >= stats.nodes + stats.object_slots);
+
+  lqt.remove(&objects[1]);
+  stats = lqt.get_memory_stats();
+  REQUIRE(stats.object_slots == 2);
+  REQUIRE(stats.tombstones == 0);
+
+  // removing during a query leaves a tombstone for the query to clean up
+  {
+    auto query = lqt.query_intersects_region(lqt.get_loose_bounding_box());
+    lqt.remove(&objects[2]);
+    stats = lqt.get_memory_stats();
+    REQUIRE(stats.object_slots == 2);
+    REQUIRE(stats.tombstones == 1);
+  }
+  lqt.force_cleanup();
+  stats = lqt.get_memory_stats();
+  REQUIRE(stats.object_slots == 1);
+  REQUIRE(stats.tombstones == 0);
+  REQUIRE(stats.query_pool_size == 1);
+  REQUIRE(stats.query_pool_bytes > 0);
+
+  // clear keeps the blocks of the tree for reuse, cleanup gives them back
+  lqt.clear();
+  stats = lqt.get_memory_stats();
+  REQUIRE(stats.nodes == 0);
+  REQUIRE(stats.object_slots == 0);
+  REQUIRE_FALSE(stats.own_pool.size_classes.empty());
+  for (auto& size_class : stats.own_pool.size_classes) {
+    REQUIRE(size_class.live_slots == 0);
+  }
+  lqt.force_cleanup();
+  REQUIRE(lqt.get_memory_stats().own_pool.size_classes.empty());
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+  }
+  REQUIRE(lqt.get_memory_stats().object_slots == 3);
+
+  CountingResource counting;
+  loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>>
+    lqt2(&counting);
+  lqt2.insert(&objects[0]);
+  stats = lqt2.get_memory_stats();
+  REQUIRE(stats.own_pool.size_classes.empty());
+  REQUIRE(stats.object_slots == 1);
+}
+
+struct CachedBoxesPolicy : loose_quadtree::default_policy {
+  static constexpr bool cache_bounding_boxes = true;
+};
+
+TEMPLATE_TEST_CASE("TestCachedBoundingBoxes", "", TYPES_FOR_TESTING) {
+  std::vector<loose_quadtree::bounding_box<TestType>> objects;
+  objects.push_back({1000, 1000, 50, 30});
+  objects.push_back({1060, 1000, 50, 30});
+  objects.push_back({1060, 1000, 5, 3});
+  loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>,
+    CachedBoxesPolicy> lqt;
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+  }
+  auto count_intersecting = [&](const loose_quadtree::bounding_box<TestType>& region) {
+    int count = 0;
+    auto query = lqt.query_intersects_region(region);
+    while (!query.end_of_query()) {
+      count++;
+      query.next();
+    }
+    return count;
+  };
+  REQUIRE(count_intersecting(loose_quadtree::bounding_box<TestType>(1000, 1000, 40, 40)) == 1);
+  REQUIRE(count_intersecting(loose_quadtree::bounding_box<TestType>(1045, 1000, 20, 10)) == 3);
+
+  // queries see the boxes as they were at the last insert or update
+  objects[0].left = 1100;
+  REQUIRE(count_intersecting(loose_quadtree::bounding_box<TestType>(1045, 1000, 20, 10)) == 3);
+  lqt.update(&objects[0]);
+  REQUIRE(count_intersecting(loose_quadtree::bounding_box<TestType>(1045, 1000, 20, 10)) == 2);
+  REQUIRE(count_intersecting(loose_quadtree::bounding_box<TestType>(1140, 1000, 10, 10)) == 1);
+
+  lqt.remove(&objects[1]);
+  REQUIRE(count_intersecting(loose_quadtree::bounding_box<TestType>(1045, 1000, 20, 10)) == 1);
+  REQUIRE(lqt.get_size() == 2);
+}
+
+struct CompactNodesPolicy : loose_quadtree::default_policy {
+  static constexpr bool compact_nodes = true;
+};
+
+TEMPLATE_TEST_CASE("TestCompactNodes", "", TYPES_FOR_TESTING) {
+  std::vector<loose_quadtree::bounding_box<TestType>> objects;
+  for (int i = 0; i < 300; i++) {
+    objects.push_back({(TestType)(1000 + i * 7 % 400), (TestType)(1000 + i * 13 % 300),
+                       (TestType)(1 + i % 40), (TestType)(1 + i % 30)});
+  }
+  loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>> lqt;
+  CountingResource counting;
+  loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>,
+    CompactNodesPolicy> compact_lqt(&counting);
+  auto require_same_results = [&]() {
+    REQUIRE(compact_lqt.get_size() == lqt.get_size());
+    for (int i = 0; i < 20; i++) {
+      loose_quadtree::bounding_box<TestType> region((TestType)(990 + i * 20), (TestType)(990 + i * 15),
+                                                    (TestType)(10 + i * 3), (TestType)(10 + i * 2));
+      REQUIRE(CountIntersecting(compact_lqt, region) == CountIntersecting(lqt, region));
+    }
+  };
+
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+    compact_lqt.insert(&obj);
+  }
+  require_same_results();
+  loose_quadtree::memory_stats stats = compact_lqt.get_memory_stats();
+  REQUIRE(stats.nodes == lqt.get_memory_stats().nodes);
+  REQUIRE(stats.node_bytes <= lqt.get_memory_stats().node_bytes);
+
+  // emptied nodes are freed by queries and reused through the free list
+  for (std::size_t i = 0; i < objects.size(); i += 2) {
+    lqt.remove(&objects[i]);
+    compact_lqt.remove(&objects[i]);
+  }
+  lqt.force_cleanup();
+  compact_lqt.force_cleanup();
+  require_same_results();
+  for (std::size_t i = 0; i < objects.size(); i += 2) {
+    objects[i].left = (TestType)(objects[i].left + 100);
+    lqt.insert(&objects[i]);
+    compact_lqt.insert(&objects[i]);
+  }
+  require_same_results();
+
+  compact_lqt.clear();
+  REQUIRE(compact_lqt.get_memory_stats().nodes == 0);
+  REQUIRE(CountIntersecting(compact_lqt, compact_lqt.get_loose_bounding_box()) == 0);
+  for (auto& obj: objects) {
+    compact_lqt.insert(&obj);
+  }
+  require_same_results();
+}
+
+struct NodeCellsPolicy : loose_quadtree::default_policy {
+  static constexpr bool cache_node_cells = true;
+};
+
+TEMPLATE_TEST_CASE("TestNodeCells", "", TYPES_FOR_TESTING) {
+  std::vector<loose_quadtree::bounding_box<TestType>> objects;
+  for (int i = 0; i < 300; i++) {
+    objects.push_back({(TestType)(10000 + i * 7 % 400), (TestType)(10000 + i * 13 % 300),
+                       (TestType)(1 + i % 40), (TestType)(1 + i % 30)});
+  }
+  loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>> lqt;
+  loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>,
+    NodeCellsPolicy> cells_lqt;
+  // objects which stay in their cells skip the descent, they have to end up where it would put them
+  auto require_same_tree = [&]() {
+    REQUIRE(cells_lqt.get_size() == lqt.get_size());
+    REQUIRE(cells_lqt.get_memory_stats().nodes == lqt.get_memory_stats().nodes);
+    for (int i = 0; i < 20; i++) {
+      loose_quadtree::bounding_box<TestType> region((TestType)(9990 + i * 20), (TestType)(9990 + i * 15),
+                                                    (TestType)(10 + i * 3), (TestType)(10 + i * 2));
+      REQUIRE(CountIntersecting(cells_lqt, region) == CountIntersecting(lqt, region));
+    }
+  };
+  auto update_both = [&](loose_quadtree::bounding_box<TestType>* obj) {
+    lqt.update(obj);
+    cells_lqt.update(obj);
+  };
+
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+    cells_lqt.insert(&obj);
+  }
+  require_same_tree();
+
+  // small moves, most of them stay, some cross into the neighbouring node
+  for (int round = 0; round < 10; round++) {
+    for (std::size_t i = 0; i < objects.size(); i++) {
+      objects[i].left = (TestType)(objects[i].left + 1 + (i + round) % 3);
+      objects[i].top = (TestType)(objects[i].top + 2 - (i + round) % 5);
+      update_both(&objects[i]);
+    }
+    require_same_tree();
+  }
+
+  // growing and shrinking objects change their depths
+  for (std::size_t i = 0; i < objects.size(); i++) {
+    objects[i].width = (TestType)(i % 2 == 0 ? objects[i].width * 3 : 1);
+    update_both(&objects[i]);
+  }
+  require_same_tree();
+
+  // the root grows, every path gets longer
+  objects[0].left = 13000;
+  update_both(&objects[0]);
+  for (std::size_t i = 1; i < objects.size(); i++) {
+    objects[i].top = (TestType)(objects[i].top + 1);
+    update_both(&objects[i]);
+  }
+  require_same_tree();
+
+  // fewer objects lower the maximal depth
+  for (std::size_t i = 0; i < objects.size(); i += 3) {
+    lqt.remove(&objects[i]);
+    cells_lqt.remove(&objects[i]);
+  }
+  for (std::size_t i = 1; i < objects.size(); i += 3) {
+    objects[i].left = (TestType)(objects[i].left + 1);
+    update_both(&objects[i]);
+  }
+  require_same_tree();
+}
+
+struct FatBoxesPolicy : loose_quadtree::default_policy {
+  static constexpr bool cache_bounding_boxes = true;
+  static constexpr bool fat_bounding_boxes = true;
+};
+
+TEMPLATE_TEST_CASE("TestFatBoundingBoxes", "", TYPES_FOR_TESTING) {
+  std::vector<loose_quadtree::bounding_box<TestType>> objects;
+  for (int i = 0; i < 300; i++) {
+    objects.push_back({(TestType)(10000 + i * 7 % 400), (TestType)(10000 + i * 13 % 300),
+                       (TestType)(1 + i % 40), (TestType)(1 + i % 30)});
+  }
+  loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>> lqt;
+  loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>,
+    FatBoxesPolicy> fat_lqt;
+  REQUIRE(fat_lqt.get_fat_margin() == 0);
+  fat_lqt.set_fat_margin(5);
+  REQUIRE(fat_lqt.get_fat_margin() == 5);
+  // objects are placed by their fat boxes, queries have to see the exact ones
+  auto require_same_results = [&]() {
+    for (int i = 0; i < 40; i++) {
+      loose_quadtree::bounding_box<TestType> region((TestType)(9990 + i * 11), (TestType)(9990 + i * 8),
+                                                    (TestType)(1 + i % 7), (TestType)(1 + i % 5));
+      REQUIRE(CountIntersecting(fat_lqt, region) == CountIntersecting(lqt, region));
+    }
+    loose_quadtree::bounding_box<TestType> everything(9000, 9000, 5000, 5000);
+    REQUIRE(CountIntersecting(fat_lqt, everything) == CountIntersecting(lqt, everything));
+  };
+  auto update_both = [&](loose_quadtree::bounding_box<TestType>* obj) {
+    lqt.update(obj);
+    fat_lqt.update(obj);
+  };
+
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+    fat_lqt.insert(&obj);
+  }
+  require_same_results();
+
+  // small moves stay inside the fat boxes, only the cached boxes change
+  for (int round = 0; round < 4; round++) {
+    for (std::size_t i = 0; i < objects.size(); i++) {
+      objects[i].left = (TestType)(objects[i].left + 1);
+      objects[i].top = (TestType)(objects[i].top + 1 - (i + round) % 2);
+      update_both(&objects[i]);
+    }
+    require_same_results();
+  }
+
+  // bigger moves and sizes leave them
+  for (std::size_t i = 0; i < objects.size(); i++) {
+    objects[i].left = (TestType)(objects[i].left + 3 + i % 20);
+    objects[i].width = (TestType)(i % 2 == 0 ? objects[i].width * 2 : 1);
+    update_both(&objects[i]);
+  }
+  require_same_results();
+
+  for (std::size_t i = 0; i < objects.size(); i += 2) {
+    lqt.remove(&objects[i]);
+    fat_lqt.remove(&objects[i]);
+  }
+  require_same_results();
+}
+
+// batches are sorted and share their descents, they have to end up where single operations would
+template<class NumberT, class PolicyT>
+void RequireBatchesLikeSingleOperations() {
+  using QuadTree = loose_quadtree::quad_tree<NumberT, loose_quadtree::bounding_box<NumberT>,
+    TrivialBBExtractor<NumberT>, PolicyT>;
+  std::vector<loose_quadtree::bounding_box<NumberT>> objects;
+  for (int i = 0; i < 300; i++) {
+    objects.push_back({(NumberT)(10000 + i * 7 % 400), (NumberT)(10000 + i * 13 % 300),
+                       (NumberT)(1 + i % 40), (NumberT)(1 + i % 30)});
+  }
+  std::vector<loose_quadtree::bounding_box<NumberT>*> pointers;
+  for (auto& obj: objects) {
+    pointers.push_back(&obj);
+  }
+  QuadTree lqt;
+  QuadTree batch_lqt;
+  lqt.set_fat_margin(2);
+  batch_lqt.set_fat_margin(2);
+  auto require_same_results = [&](QuadTree& other_lqt) {
+    REQUIRE(other_lqt.get_size() == lqt.get_size());
+    for (int i = 0; i < 20; i++) {
+      loose_quadtree::bounding_box<NumberT> region((NumberT)(9990 + i * 20), (NumberT)(9990 + i * 15),
+                                                   (NumberT)(10 + i * 3), (NumberT)(10 + i * 2));
+      REQUIRE(CountIntersecting(other_lqt, region) == CountIntersecting(lqt, region));
+    }
+  };
+
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+    batch_lqt.insert(&obj);
+  }
+  // moves inside the root, where the objects go does not depend on the order of the updates
+  const std::vector<loose_quadtree::bounding_box<NumberT>> bases = objects;
+  for (int round = 0; round < 6; round++) {
+    for (std::size_t i = 0; i < objects.size(); i++) {
+      objects[i].left = (NumberT)(bases[i].left + (i + round) % 5 * 2);
+      objects[i].top = (NumberT)(bases[i].top + (i * 3 + round) % 7);
+      objects[i].width = (NumberT)(bases[i].width + (i + round) % 2 * bases[i].width / 2);
+      lqt.update(&objects[i]);
+    }
+    REQUIRE(batch_lqt.update_many(pointers.data(), pointers.size()) == objects.size());
+    REQUIRE(batch_lqt.get_memory_stats().nodes == lqt.get_memory_stats().nodes);
+    require_same_results(batch_lqt);
+  }
+
+  // and with a growing root
+  for (std::size_t i = 0; i < objects.size(); i++) {
+    objects[i].left = (NumberT)(objects[i].left + i % 4 * 200);
+    lqt.update(&objects[i]);
+  }
+  REQUIRE(batch_lqt.update_many(pointers.data(), pointers.size()) == objects.size());
+  require_same_results(batch_lqt);
+
+  // the same object twice is inserted and removed once
+  std::vector<loose_quadtree::bounding_box<NumberT>*> halves;
+  for (std::size_t i = 0; i < objects.size(); i += 2) {
+    halves.push_back(&objects[i]);
+    halves.push_back(&objects[i]);
+    lqt.remove(&objects[i]);
+  }
+  REQUIRE(batch_lqt.remove_many(halves.data(), halves.size()) == objects.size() / 2);
+  REQUIRE(batch_lqt.remove_many(halves.data(), halves.size()) == 0);
+  require_same_results(batch_lqt);
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+  }
+  REQUIRE(batch_lqt.insert_many(halves.data(), halves.size()) == objects.size() / 2);
+  REQUIRE(batch_lqt.update_many(pointers.data(), pointers.size()) == objects.size());
+  require_same_results(batch_lqt);
+
+  QuadTree empty_lqt;
+  empty_lqt.set_fat_margin(2);
+  REQUIRE(empty_lqt.update_many(pointers.data(), pointers.size()) == 0);
+  require_same_results(empty_lqt);
+  REQUIRE(empty_lqt.remove_many(pointers.data(), pointers.size()) == objects.size());
+  REQUIRE(empty_lqt.get_size() == 0);
+}
+
+struct FatCellsPolicy : loose_quadtree::default_policy {
+  static constexpr bool compact_nodes = true;
+  static constexpr bool cache_node_cells = true;
+  static constexpr bool fat_bounding_boxes = true;
+};
+
+TEMPLATE_TEST_CASE("TestBatches", "", TYPES_FOR_TESTING) {
+  RequireBatchesLikeSingleOperations<TestType, loose_quadtree::default_policy>();
+  RequireBatchesLikeSingleOperations<TestType, FatCellsPolicy>();
+}
+
+TEMPLATE_TEST_CASE("TestBuild", "", TYPES_FOR_TESTING) {
+  std::vector<loose_quadtree::bounding_box<TestType>> objects;
+  for (int i = 0; i < 500; i++) {
+    objects.push_back({(TestType)(10000 + i * 7 % 400), (TestType)(10000 + i * 13 % 300),
+                       (TestType)(1 + i % 40 * (i % 11 == 0 ? 8 : 1)), (TestType)(1 + i % 30)});
+  }
+  std::vector<loose_quadtree::bounding_box<TestType>*> pointers;
+  for (auto& obj: objects) {
+    pointers.push_back(&obj);
+  }
+  loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>> lqt;
+  loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>,
+    FatCellsPolicy> built_lqt;
+  built_lqt.set_fat_margin(2);
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+  }
+  // the built tree answers like the inserted one, and stays right when it changes
+  auto require_same_results = [&]() {
+    REQUIRE(built_lqt.get_size() == lqt.get_size());
+    for (int i = 0; i < 20; i++) {
+      loose_quadtree::bounding_box<TestType> region((TestType)(9990 + i * 20), (TestType)(9990 + i * 15),
+                                                    (TestType)(10 + i * 3), (TestType)(10 + i * 2));
+      REQUIRE(CountIntersecting(built_lqt, region) == CountIntersecting(lqt, region));
+    }
+  };
+
+  built_lqt.insert(&objects[0]);
+  pointers.push_back(&objects[0]); // the same object twice is put in once
+  built_lqt.build(pointers.data(), pointers.size());
+  pointers.pop_back();
+  require_same_results();
+  for (auto& obj: objects) {
+    REQUIRE(built_lqt.contains(&obj));
+  }
+
+  for (std::size_t i = 0; i < objects.size(); i++) {
+    objects[i].left = (TestType)(objects[i].left + i % 5);
+    objects[i].top = (TestType)(objects[i].top + i % 3 * 4);
+    lqt.update(&objects[i]);
+    built_lqt.update(&objects[i]);
+  }
+  require_same_results();
+  for (std::size_t i = 0; i < objects.size(); i += 2) {
+    lqt.remove(&objects[i]);
+    built_lqt.remove(&objects[i]);
+  }
+  require_same_results();
+
+  built_lqt.build(pointers.data(), 1);
+  REQUIRE(built_lqt.get_size() == 1);
+  REQUIRE(built_lqt.contains(&objects[0]));
+  built_lqt.build(pointers.data(), 0);
+  REQUIRE(built_lqt.is_empty());
+  REQUIRE(built_lqt.get_memory_stats().nodes == 0);
+}
+
+TEMPLATE_TEST_CASE("TestParallelBuild", "", TYPES_FOR_TESTING) {
+  std::vector<loose_quadtree::bounding_box<TestType>> objects;
+  for (int i = 0; i < 3000; i++) {
+    objects.push_back({(TestType)(10000 + i * 7 % 4000), (TestType)(10000 + i * 13 % 3000),
+                       (TestType)(1 + i % 40 * (i % 11 == 0 ? 8 : 1)), (TestType)(1 + i % 30)});
+  }
+  std::vector<loose_quadtree::bounding_box<TestType>*> pointers;
+  for (auto& obj: objects) {
+    pointers.push_back(&obj);
+  }
+  pointers.push_back(&objects[7]);
+  using QuadTree = loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>,
+    TrivialBBExtractor<TestType>, FatCellsPolicy>;
+  QuadTree lqt;
+  lqt.build(pointers.data(), pointers.size());
+  auto require_same_tree = [&](QuadTree& built_lqt) {
+    REQUIRE(built_lqt.get_size() == lqt.get_size());
+    REQUIRE(built_lqt.get_memory_stats().nodes == lqt.get_memory_stats().nodes);
+    REQUIRE(built_lqt.get_memory_stats().object_slots == lqt.get_memory_stats().object_slots);
+    for (int i = 0; i < 20; i++) {
+      loose_quadtree::bounding_box<TestType> region((TestType)(9990 + i * 200), (TestType)(9990 + i * 150),
+                                                    (TestType)(100 + i * 30), (TestType)(100 + i * 20));
+      // the same nodes hold the same objects in the same order
+      auto query = lqt.query_intersects_region(region);
+      auto built_query = built_lqt.query_intersects_region(region);
+      while (!query.end_of_query()) {
+        REQUIRE_FALSE(built_query.end_of_query());
+        REQUIRE(built_query.get_current() == query.get_current());
+        query.next();
+        built_query.next();
+      }
+      REQUIRE(built_query.end_of_query());
+    }
+  };
+
+  QuadTree threads_lqt;
+  threads_lqt.build(pointers.data(), pointers.size(), loose_quadtree::thread_build_executor(4));
+  require_same_tree(threads_lqt);
+  // the tasks may run in any order
+  QuadTree reversed_lqt;
+  std::size_t executed_tasks = 0;
+  reversed_lqt.build(pointers.data(), pointers.size(), [&](std::vector<std::function<void()>>& tasks) {
+    for (std::size_t i = tasks.size(); i > 0; i--) {
+      tasks[i - 1]();
+    }
+    executed_tasks += tasks.size();
+  });
+  require_same_tree(reversed_lqt);
+  REQUIRE(executed_tasks > 1);
+  reversed_lqt.build(pointers.data(), 0, loose_quadtree::thread_build_executor(4));
+  REQUIRE(reversed_lqt.is_empty());
+}
+
+TEMPLATE_TEST_CASE("TestReserveBounds", "", TYPES_FOR_TESTING) {
+  std::vector<loose_quadtree::bounding_box<TestType>> objects;
+  for (int i = 0; i < 300; i++) {
+    objects.push_back({(TestType)(1100 + i * 7 % 1800), (TestType)(1100 + i * 13 % 1800),
+                       (TestType)(1 + i % 40), (TestType)(1 + i % 30)});
+  }
+  loose_quadtree::bounding_box<TestType> far_object(9000, 7000, 10, 10);
+  loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>> lqt;
+  loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>, TrivialBBExtractor<TestType>,
+    FatCellsPolicy> reserved_lqt;
+  const loose_quadtree::bounding_box<TestType> reserved(1000, 1000, 4000, 3000);
+  auto require_same_results = [&]() {
+    REQUIRE(reserved_lqt.get_size() == lqt.get_size());
+    for (int i = 0; i < 20; i++) {
+      loose_quadtree::bounding_box<TestType> region((TestType)(1090 + i * 90), (TestType)(1090 + i * 75),
+                                                    (TestType)(10 + i * 30), (TestType)(10 + i * 20));
+      REQUIRE(CountIntersecting(reserved_lqt, region) == CountIntersecting(lqt, region));
+    }
+    // the loose bounds of the root reach below 0, unsigned ones must not wrap around
+    REQUIRE(CountIntersecting(reserved_lqt, reserved_lqt.get_loose_bounding_box()) == reserved_lqt.get_size());
+  };
+  auto require_bounds = [&](TestType left, TestType top, TestType size) {
+    const loose_quadtree::bounding_box<TestType>& bounds = reserved_lqt.get_loose_bounding_box();
+    REQUIRE(bounds.left == left);
+    REQUIRE(bounds.top == top);
+    REQUIRE(bounds.width == size);
+    REQUIRE(bounds.height == size);
+  };
+
+  // the root is there before the objects and stays as it is
+  reserved_lqt.reserve_bounds(reserved);
+  require_bounds(1000, 1000, 4000);
+  REQUIRE(reserved_lqt.get_memory_stats().nodes == 1);
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+    reserved_lqt.insert(&obj);
+  }
+  require_bounds(1000, 1000, 4000);
+  require_same_results();
+
+  // objects outside still grow it, and once they are gone the root shrinks back
+  lqt.insert(&far_object);
+  reserved_lqt.insert(&far_object);
+  require_bounds(1000, 1000, 16000);
+  require_same_results();
+  lqt.remove(&far_object);
+  reserved_lqt.remove(&far_object);
+  reserved_lqt.shrink_bounds();
+  require_bounds(1000, 1000, 16000); // the empty nodes are still there
+  reserved_lqt.force_cleanup();
+  require_bounds(1000, 1000, 4000);
+  require_same_results();
+
+  // without the reservation it gets down to the contents, their cells change with the root
+  reserved_lqt.reserve_bounds({0, 0, 0, 0});
+  reserved_lqt.force_cleanup();
+  require_bounds(1000, 1000, 2000);
+  for (std::size_t i = 0; i < objects.size(); i++) {
+    objects[i].left = (TestType)(objects[i].left + i % 5);
+    lqt.update(&objects[i]);
+    reserved_lqt.update(&objects[i]);
+  }
+  require_same_results();
+
+  // a reservation covers the contents of a tree with its root
+  reserved_lqt.reserve_bounds({2500, 2000, 3000, 2500});
+  require_bounds(1000, 1000, 8000);
+  require_same_results();
+
+  std::vector<loose_quadtree::bounding_box<TestType>*> pointers;
+  for (auto& obj: objects) {
+    pointers.push_back(&obj);
+  }
+  reserved_lqt.reserve_bounds(reserved);
+  reserved_lqt.build(pointers.data(), pointers.size());
+  require_bounds(1000, 1000, 4000);
+  require_same_results();
+  reserved_lqt.clear();
+  reserved_lqt.insert(&objects[0]);
+  require_bounds(1000, 1000, 4000);
+}
+
+TEMPLATE_TEST_CASE("TestMaintain", "", TYPES_FOR_TESTING) {
+  std::vector<loose_quadtree::bounding_box<TestType>> objects;
+  for (int i = 0; i < 2000; i++) {
+    objects.push_back({(TestType)(1000 + i * 37 % 5000), (TestType)(1000 + i * 53 % 5000),
+                       (TestType)(1 + i % 7), (TestType)(1 + i % 5)});
+  }
+  using QuadTree = loose_quadtree::quad_tree<TestType, loose_quadtree::bounding_box<TestType>,
+    TrivialBBExtractor<TestType>>;
+  QuadTree lqt;
+  QuadTree cleaned_lqt; // cleaned up by a query of its own
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+    cleaned_lqt.insert(&obj);
+  }
+  std::size_t full_nodes = lqt.get_memory_stats().nodes;
+  auto require_found_by_queries = [&]() {
+    for (int i = 0; i < 20; i++) {
+      loose_quadtree::bounding_box<TestType> region((TestType)(990 + i * 250), (TestType)(990 + i * 200),
+                                                    (TestType)(100 + i * 30), (TestType)(100 + i * 20));
+      int count = 0;
+      for (std::size_t j = 0; j < objects.size(); j++) {
+        count += lqt.contains(&objects[j]) && region.intersects(objects[j]) ? 1 : 0;
+      }
+      REQUIRE(CountIntersecting(lqt, region) == count);
+    }
+  };
+
+  {
+    // a query stays open all along, so it can't clean up on its own
+    auto query = lqt.query_intersects_region({0, 0, 3000, 3000});
+    REQUIRE_FALSE(query.end_of_query());
+    query.next();
+    for (std::size_t i = 0; i < objects.size(); i++) {
+      if (i % 20 != 0) {
+        lqt.remove(&objects[i]);
+        cleaned_lqt.remove(&objects[i]);
+      }
+    }
+    REQUIRE(lqt.get_memory_stats().tombstones > 0);
+    int calls = 1;
+    while (!lqt.maintain(10)) {
+      calls++;
+    }
+    REQUIRE(calls > 1);
+    {
+      loose_quadtree::memory_stats stats = lqt.get_memory_stats();
+      REQUIRE(stats.nodes < full_nodes);
+      REQUIRE(stats.tombstones < 10); // the ones in the node the query is at
+    }
+    // the query goes on over the objects still there (its current one may be gone)
+    for (query.next(); !query.end_of_query(); query.next()) {
+      REQUIRE(lqt.contains(query.get_current()));
+    }
+  }
+  {
+    // the bucket of the node a query reads stays as it is
+    std::vector<loose_quadtree::bounding_box<TestType>> cluster(6, objects[0]);
+    for (auto& obj: cluster) {
+      lqt.insert(&obj);
+    }
+    auto query = lqt.query_intersects_region(objects[0]);
+    std::vector<loose_quadtree::bounding_box<TestType>*> first_seen;
+    std::vector<loose_quadtree::bounding_box<TestType>*> seen;
+    for (auto other = lqt.query_intersects_region(objects[0]); !other.end_of_query(); other.next()) {
+      first_seen.push_back(other.get_current());
+    }
+    REQUIRE(first_seen.size() > 1);
+    seen.push_back(query.get_current());
+    query.next();
+    lqt.remove(seen.back()); // leaves an entry behind the query
+    lqt.maintain(1000000);
+    for (; !query.end_of_query(); query.next()) {
+      seen.push_back(query.get_current());
+    }
+    REQUIRE(seen == first_seen);
+    lqt.insert(seen[0]);
+    for (auto& obj: cluster) {
+      lqt.remove(&obj);
+    }
+  }
+  REQUIRE(lqt.maintain(1000000));
+  cleaned_lqt.force_cleanup();
+  // moved up to where the smaller tree keeps them, like a query cleaning up does it
+  REQUIRE(lqt.get_memory_stats().tombstones == 0);
+  REQUIRE(lqt.get_memory_stats().nodes == cleaned_lqt.get_memory_stats().nodes);
+  require_found_by_queries();
+
+  for (std::size_t i = 0; i < objects.size(); i += 20) {
+    lqt.remove(&objects[i]);
+  }
+  REQUIRE(lqt.maintain(1000000));
+  REQUIRE(lqt.get_memory_stats().nodes == 0);
+  REQUIRE(lqt.maintain(1));
+}
+
+struct NodeCapacityPolicy : loose_quadtree::default_policy {
+  static constexpr std::size_t node_capacity = 8;
+  static constexpr int minimal_depth = 2;
+  static constexpr int maximal_depth = 10;
+};
+
+struct NodeCapacityCellsPolicy : FatCellsPolicy {
+  static constexpr std::size_t node_capacity = 8;
+  static constexpr int minimal_depth = 2;
+  static constexpr int maximal_depth = 10;
+};
+
+template<class NumberT, class PolicyT>
+void RequireNodeCapacityKept() {
+  using QuadTree = loose_quadtree::quad_tree<NumberT, loose_quadtree::bounding_box<NumberT>,
+    TrivialBBExtractor<NumberT>, PolicyT>;
+  {
+    // nine objects in the four quarters of a node at the minimal depth
+    std::vector<loose_quadtree::bounding_box<NumberT>> objects;
+    for (int i = 0; i < 9; i++) {
+      objects.push_back({(NumberT)(520 + i % 2 * 128 + i), (NumberT)(520 + i / 2 % 2 * 128 + i), 2, 2});
+    }
+    QuadTree lqt;
+    lqt.reserve_bounds({0, 0, 1024, 1024});
+    for (int i = 0; i < 8; i++) {
+      lqt.insert(&objects[i]);
+    }
+    REQUIRE(lqt.get_memory_stats().nodes == 3); // the root and the way down
+    lqt.insert(&objects[8]);
+    REQUIRE(lqt.get_memory_stats().nodes == 7); // one more splits it
+    lqt.remove(&objects[8]);
+    REQUIRE(lqt.get_memory_stats().nodes == 7);
+    REQUIRE(lqt.maintain(100));
+    REQUIRE(lqt.get_memory_stats().nodes == 3); // maintain takes them back
+    {
+      // a running query holds the split back until maintain
+      auto query = lqt.query_intersects_region({0, 0, 1024, 1024});
+      lqt.insert(&objects[8]);
+      REQUIRE(lqt.get_memory_stats().nodes == 4);
+      for (; !query.end_of_query(); query.next()) {}
+    }
+    REQUIRE(lqt.maintain(100));
+    REQUIRE(lqt.get_memory_stats().nodes == 7);
+    REQUIRE(CountIntersecting(lqt, loose_quadtree::bounding_box<NumberT>(0, 0, 1024, 1024)) == 9);
+
+    // the same place over and over goes down to the maximal depth
+    std::vector<loose_quadtree::bounding_box<NumberT>> pile(30, {700, 700, 1, 1});
+    QuadTree pile_lqt;
+    pile_lqt.reserve_bounds({0, 0, 1024, 1024});
+    for (auto& obj: pile) {
+      pile_lqt.insert(&obj);
+    }
+    REQUIRE(pile_lqt.get_memory_stats().nodes == 11);
+    REQUIRE(CountIntersecting(pile_lqt, loose_quadtree::bounding_box<NumberT>(700, 700, 1, 1)) == 30);
+  }
+
+  // a sparse spread and a dense cluster, the nodes only go deep in the cluster
+  std::vector<loose_quadtree::bounding_box<NumberT>> objects;
+  for (int i = 0; i < 200; i++) {
+    objects.push_back({(NumberT)(10000 + i * 97 % 4000), (NumberT)(10000 + i * 61 % 4000),
+                       (NumberT)(1 + i % 5 * (i % 17 == 0 ? 90 : 1)), (NumberT)(1 + i % 3)});
+  }
+  for (int i = 0; i < 400; i++) {
+    objects.push_back({(NumberT)(12000 + i * 7 % 40), (NumberT)(12000 + i * 13 % 30),
+                       (NumberT)(1 + i % 3), (NumberT)(1 + i % 2)});
+  }
+  std::vector<loose_quadtree::bounding_box<NumberT>*> pointers;
+  for (auto& obj: objects) {
+    pointers.push_back(&obj);
+  }
+  loose_quadtree::quad_tree<NumberT, loose_quadtree::bounding_box<NumberT>, TrivialBBExtractor<NumberT>> lqt;
+  QuadTree capacity_lqt;
+  QuadTree built_lqt;
+  capacity_lqt.set_fat_margin(1);
+  built_lqt.set_fat_margin(1);
+  capacity_lqt.reserve_bounds({8192, 8192, 8192, 8192}); // the same root for both
+  built_lqt.reserve_bounds({8192, 8192, 8192, 8192});
+  auto require_same_results = [&](QuadTree& other_lqt) {
+    REQUIRE(other_lqt.get_size() == lqt.get_size());
+    for (int i = 0; i < 30; i++) {
+      loose_quadtree::bounding_box<NumberT> region((NumberT)(9990 + i * 130), (NumberT)(9990 + i * 130),
+                                                   (NumberT)(10 + i * 3), (NumberT)(10 + i * 2));
+      REQUIRE(CountIntersecting(other_lqt, region) == CountIntersecting(lqt, region));
+      loose_quadtree::bounding_box<NumberT> cluster_region((NumberT)(11995 + i), (NumberT)(11995 + i % 7 * 4),
+                                                           (NumberT)(1 + i % 9), (NumberT)(1 + i % 4));
+      REQUIRE(CountIntersecting(other_lqt, cluster_region) == CountIntersecting(lqt, cluster_region));
+    }
+  };
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+    capacity_lqt.insert(&obj);
+  }
+  require_same_results(capacity_lqt);
+  // splitting the nodes as they fill up ends up where sorting all at once does
+  built_lqt.build(pointers.data(), pointers.size());
+  require_same_results(built_lqt);
+  REQUIRE(built_lqt.get_memory_stats().nodes == capacity_lqt.get_memory_stats().nodes);
+
+  for (std::size_t i = 0; i < objects.size(); i++) {
+    objects[i].left = (NumberT)(objects[i].left + i % 5);
+    objects[i].top = (NumberT)(objects[i].top + i % 3 * 4);
+    lqt.update(&objects[i]);
+    capacity_lqt.update(&objects[i]);
+    built_lqt.update(&objects[i]);
+  }
+  require_same_results(capacity_lqt);
+  require_same_results(built_lqt);
+  for (std::size_t i = 0; i < objects.size(); i++) {
+    if (i % 8 != 0) {
+      lqt.remove(&objects[i]);
+      capacity_lqt.remove(&objects[i]);
+    }
+  }
+  std::size_t split_nodes = capacity_lqt.get_memory_stats().nodes;
+  REQUIRE(capacity_lqt.maintain(1000000));
+  REQUIRE(capacity_lqt.get_memory_stats().nodes < split_nodes);
+  require_same_results(capacity_lqt);
+}
+
+TEMPLATE_TEST_CASE("TestNodeCapacity", "", TYPES_FOR_TESTING) {
+  RequireNodeCapacityKept<TestType, NodeCapacityPolicy>();
+  RequireNodeCapacityKept<TestType, NodeCapacityCellsPolicy>();
+}
+
+struct TightLoosenessPolicy : loose_quadtree::default_policy {
+  using looseness = std::ratio<5, 4>;
+};
+
+struct TightLoosenessCellsPolicy : FatCellsPolicy {
+  using looseness = std::ratio<3, 2>;
+};
+
+template<class QueryT>
+int CountFound(QueryT query) {
+  int count = 0;
+  for (; !query.end_of_query(); query.next()) {
+    count++;
+  }
+  return count;
+}
+
+template<class NumberT, class PolicyT>
+void RequireLoosenessKept(std::size_t expected_nodes) {
+  using QuadTree = loose_quadtree::quad_tree<NumberT, loose_quadtree::bounding_box<NumberT>,
+    TrivialBBExtractor<NumberT>, PolicyT>;
+  {
+    // the object sits as deep as the children still take it
+    loose_quadtree::bounding_box<NumberT> object(500, 500, 100, 100);
+    QuadTree lqt;
+    lqt.reserve_bounds({0, 0, 1024, 1024});
+    lqt.insert(&object);
+    REQUIRE(lqt.get_memory_stats().nodes == expected_nodes);
+    REQUIRE(CountFound(lqt.query_intersects_region({599, 599, 5, 5})) == 1);
+    REQUIRE(CountFound(lqt.query_intersects_region({600, 600, 5, 5})) == 0);
+  }
+
+  std::vector<loose_quadtree::bounding_box<NumberT>> objects;
+  for (int i = 0; i < 500; i++) {
+    objects.push_back({(NumberT)(10000 + i * 7 % 400), (NumberT)(10000 + i * 13 % 300),
+                       (NumberT)(1 + i % 40 * (i % 11 == 0 ? 8 : 1)), (NumberT)(1 + i % 30)});
+  }
+  std::vector<loose_quadtree::bounding_box<NumberT>*> pointers;
+  for (auto& obj: objects) {
+    pointers.push_back(&obj);
+  }
+  loose_quadtree::quad_tree<NumberT, loose_quadtree::bounding_box<NumberT>, TrivialBBExtractor<NumberT>> lqt;
+  QuadTree tight_lqt;
+  QuadTree built_lqt;
+  tight_lqt.set_fat_margin(2);
+  built_lqt.set_fat_margin(2);
+  auto require_same_results = [&](QuadTree& other_lqt) {
+    REQUIRE(other_lqt.get_size() == lqt.get_size());
+    for (int i = 0; i < 20; i++) {
+      loose_quadtree::bounding_box<NumberT> region((NumberT)(9990 + i * 20), (NumberT)(9990 + i * 15),
+                                                   (NumberT)(10 + i * 3), (NumberT)(10 + i * 2));
+      REQUIRE(CountFound(other_lqt.query_intersects_region(region)) ==
+              CountFound(lqt.query_intersects_region(region)));
+      REQUIRE(CountFound(other_lqt.query_inside_region(region)) ==
+              CountFound(lqt.query_inside_region(region)));
+      loose_quadtree::bounding_box<NumberT> point_region((NumberT)(10000 + i * 19), (NumberT)(10000 + i * 14), 1, 1);
+      REQUIRE(CountFound(other_lqt.query_contains_region(point_region)) ==
+              CountFound(lqt.query_contains_region(point_region)));
+    }
+  };
+
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+    tight_lqt.insert(&obj);
+  }
+  require_same_results(tight_lqt);
+  built_lqt.build(pointers.data(), pointers.size());
+  require_same_results(built_lqt);
+  for (std::size_t i = 0; i < objects.size(); i++) {
+    objects[i].left = (NumberT)(objects[i].left + i % 5 * 3);
+    objects[i].width = (NumberT)(objects[i].width + i % 4);
+    lqt.update(&objects[i]);
+    tight_lqt.update(&objects[i]);
+    built_lqt.update(&objects[i]);
+  }
+  require_same_results(tight_lqt);
+  require_same_results(built_lqt);
+  for (std::size_t i = 0; i < objects.size(); i += 2) {
+    lqt.remove(&objects[i]);
+    tight_lqt.remove(&objects[i]);
+  }
+  require_same_results(tight_lqt);
+}
+
+TEMPLATE_TEST_CASE("TestLooseness", "", TYPES_FOR_TESTING) {
+  RequireLoosenessKept<TestType, loose_quadtree::default_policy>(4);
+  RequireLoosenessKept<TestType, TightLoosenessPolicy>(2);
+  RequireLoosenessKept<TestType, TightLoosenessCellsPolicy>(3);
+}
+
+template<class NumberT>
+class CountingBBExtractor {
+public:
+  static int extractions;
+
+  static void ExtractBoundingBox(const loose_quadtree::bounding_box<NumberT>* object,
+                                 loose_quadtree::bounding_box<NumberT>* bbox) {
+    extractions++;
+    TrivialBBExtractor<NumberT>::ExtractBoundingBox(object, bbox);
+  }
+};
+
+template<class NumberT>
+int CountingBBExtractor<NumberT>::extractions = 0;
+
+template<class NumberT, class PolicyT>
+void RequireOversizedIndexKept() {
+  using QuadTree = loose_quadtree::quad_tree<NumberT, loose_quadtree::bounding_box<NumberT>,
+    CountingBBExtractor<NumberT>, PolicyT>;
+  std::vector<loose_quadtree::bounding_box<NumberT>> objects;
+  // strips across most of the world stay in the root
+  for (int i = 0; i < 200; i++) {
+    NumberT length = (NumberT)(600 + i * 37 % 300);
+    NumberT breadth = (NumberT)(1 + i % 5);
+    if (i % 2 == 0) {
+      objects.push_back({(NumberT)(i * 3 % 400), (NumberT)(i * 5), length, breadth});
+    }
+    else {
+      objects.push_back({(NumberT)(i * 5), (NumberT)(i * 3 % 400), breadth, length});
+    }
+  }
+  for (int i = 0; i < 300; i++) {
+    objects.push_back({(NumberT)(i * 7 % 1000), (NumberT)(i * 13 % 1000), (NumberT)(1 + i % 20), (NumberT)(1 + i % 10)});
+  }
+  std::vector<bool> inserted(objects.size(), true);
+  QuadTree lqt;
+  lqt.set_fat_margin(2);
+  lqt.reserve_bounds({0, 0, 1024, 1024});
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+  }
+  auto require_found = [&](const loose_quadtree::bounding_box<NumberT>& region) {
+    int intersecting = 0, inside = 0, containing = 0;
+    for (std::size_t i = 0; i < objects.size(); i++) {
+      if (inserted[i]) {
+        intersecting += region.intersects(objects[i]) ? 1 : 0;
+        inside += region.contains(objects[i]) ? 1 : 0;
+        containing += objects[i].contains(region) ? 1 : 0;
+      }
+    }
+    REQUIRE(CountFound(lqt.query_intersects_region(region)) == intersecting);
+    REQUIRE(CountFound(lqt.query_inside_region(region)) == inside);
+    REQUIRE(CountFound(lqt.query_contains_region(region)) == containing);
+  };
+  auto require_all_found = [&]() {
+    for (int i = 0; i < 30; i++) {
+      require_found({(NumberT)(i * 31 % 1000), (NumberT)(i * 17 % 1000), (NumberT)(1 + i % 4), (NumberT)(1 + i % 3)});
+      require_found({(NumberT)(i * 29 % 900), (NumberT)(i * 23 % 900), (NumberT)(50 + i * 7), (NumberT)(40 + i * 5)});
+    }
+    // the edges of the strips
+    require_found({objects[0].left, objects[0].top, 0, 0});
+    require_found({(NumberT)(objects[1].left + objects[1].width), objects[1].top, 1, 1});
+  };
+
+  require_all_found();
+  // the root is sorted already, a small region only extracts the strips near it
+  CountingBBExtractor<NumberT>::extractions = 0;
+  REQUIRE(CountFound(lqt.query_intersects_region({700, 900, 2, 2})) >= 0);
+  REQUIRE(CountingBBExtractor<NumberT>::extractions < 100);
+
+  for (std::size_t i = 0; i < objects.size(); i += 3) {
+    objects[i].left = (NumberT)(objects[i].left + 1 + i % 7);
+    objects[i].top = (NumberT)(objects[i].top + i % 2);
+    lqt.update(&objects[i]);
+  }
+  require_all_found();
+  for (std::size_t i = 0; i < objects.size(); i += 4) {
+    objects[i].width = (NumberT)(objects[i].width / 2 + 1);
+    lqt.update(&objects[i]);
+  }
+  require_all_found();
+
+  // objects move and go while a query is in the root
+  loose_quadtree::bounding_box<NumberT> region(300, 300, 20, 20);
+  auto query = lqt.query_intersects_region(region);
+  std::vector<bool> found(objects.size(), false);
+  for (std::size_t i = 1; !query.end_of_query(); i++, query.next()) {
+    found[query.get_current() - objects.data()] = true;
+    std::size_t other = i * 11 % 200;
+    if (!found[other] && inserted[other] && query.get_current() != &objects[other]) {
+      lqt.remove(&objects[other]);
+      inserted[other] = false;
+    }
+  }
+  for (std::size_t i = 0; i < objects.size(); i++) {
+    REQUIRE(found[i] == (inserted[i] && region.intersects(objects[i])));
+  }
+  require_all_found();
+  for (std::size_t i = 0; i < objects.size(); i += 2) {
+    if (inserted[i]) {
+      lqt.remove(&objects[i]);
+      inserted[i] = false;
+    }
+  }
+  require_all_found();
+  lqt.clear();
+  std::fill(inserted.begin(), inserted.end(), true);
+  for (auto& obj: objects) {
+    lqt.insert(&obj);
+  }
+  require_all_found();
+}
+
+TEMPLATE_TEST_CASE("TestOversizedIndex", "", TYPES_FOR_TESTING) {
+  RequireOversizedIndexKept<TestType, loose_quadtree::default_policy>();
+  RequireOversizedIndexKept<TestType, FatCellsPolicy>();
+  RequireOversizedIndexKept<TestType, NodeCapacityPolicy>();
+}
+
 TEMPLATE_TEST_CASE("TestQueryIntersects", "", TYPES_FOR_TESTING) {
   std::vector<loose_quadtree::bounding_box<TestType>> objects;
   objects.push_back({10000, 10000, 8000, 8000});//0